@@ -16,25 +16,39 @@
  * limitations under the License.
  */
 
-SX127x::SX127x(PinName dio_0, PinName dio_1, PinName cs, SPI& spi_r, PinName rst) :
-                dio0(dio_0), dio1(dio_1), m_cs(cs), m_spi(spi_r), reset_pin(rst)
+#ifndef SX127X_HOST
+SX127x::SX127x(PinName dio_0, PinName dio_1, PinName cs, SPI& spi_r, PinName rst, PinName dio_3) :
+                m_hal(*new SX127x_mbed_hal(dio_0, dio_1, cs, spi_r, rst, dio_3)), owns_hal(true), xact_depth(0), dio_irq(0), dio_flags(0), bus_busy(false), bus_work_pending(false), async_busy(false)
+{
+    init();
+}
+#endif
+
+SX127x::SX127x(SX127x_hal& hal) : m_hal(hal), owns_hal(false), xact_depth(0), dio_irq(0), dio_flags(0), bus_busy(false), bus_work_pending(false), async_busy(false)
 {
-    reset_pin.input();
-    m_cs = 1;
-    m_spi.format(8, 0);
-    m_spi.frequency(3000000);
-    
     init();
 }
 
 SX127x::~SX127x()
 {
     set_opmode(RF_OPMODE_SLEEP);
+    if (owns_hal)
+        delete &m_hal;
 }
 
 void SX127x::init()
 {
+    SX127X_PROBE(init, m_hal);
     type = SX_NONE;
+#ifdef SX127X_NO_PKT_BUFS
+    rx_dest = NULL;
+#else
+    rx_dest = rx_buf;
+#endif
+
+    /* radio may have been reset: nothing known about its registers */
+    shadow_invalidate();
+    fsk_page = true;
 
     RegOpMode.octet = read_reg(REG_OPMODE);
     RegPaConfig.octet = read_reg(REG_PACONFIG);
@@ -52,6 +66,8 @@ void SX127x::init()
     RegLna.octet = read_reg(REG_LNA);
     RegLna.bits.LnaBoostHF = 3;
     write_reg(REG_LNA, RegLna.octet);    
+
+    get_frf_hz();   // sets HF
 }
 
 void SX127x::get_type()
@@ -61,10 +77,10 @@ void SX127x::get_type()
     /* SX1272 starts in FSK mode on powerup, RegOpMode bit3 will be set for BT1.0 in FSK */
     if (!RegOpMode.bits.LongRangeMode) {
         set_opmode(RF_OPMODE_SLEEP);
-        wait(0.01);
+        m_hal.wait_us(10000);
         RegOpMode.bits.LongRangeMode = 1;
         write_reg(REG_OPMODE, RegOpMode.octet);
-        wait(0.01);
+        m_hal.wait_us(10000);
         RegOpMode.octet = read_reg(REG_OPMODE);     
     }
 
@@ -81,135 +97,460 @@ void SX127x::get_type()
     }
 }
 
-void
-SX127x::ReadBuffer( uint8_t addr, uint8_t *buffer, uint8_t size )
+/* registers changed by the radio itself (FIFO, status, trigger bits): never cached, never skipped */
+static const uint8_t volatile_lora[16] = {  // 0x00 0x01 0x0d 0x10 0x12->0x1c 0x25 0x28->0x2c
+    0x03, 0x20, 0xfd, 0x1f, 0x20, 0x1f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+static const uint8_t volatile_fsk[16] = {   // 0x00 0x01 0x0d 0x11 0x1a->0x1e 0x24 0x36 0x3b 0x3c 0x3e 0x3f
+    0x03, 0x20, 0x02, 0x7c, 0x10, 0x00, 0x40, 0xd8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+#define SHADOW_BIT(a)       (1 << ((a) & 7))
+#define PAGED_REG(a)        (((a) >= 0x02 && (a) <= 0x05) || ((a) >= 0x0d && (a) <= 0x3f))
+
+void SX127x::shadow_invalidate()
+{
+    memset(shadow_valid, 0, sizeof(shadow_valid));
+    memset(shadow_dirty, 0, sizeof(shadow_dirty));
+    shadow_pending = false;
+}
+
+bool SX127x::shadow_cacheable(uint8_t addr)
+{
+    const uint8_t* v = fsk_page ? volatile_fsk : volatile_lora;
+    return !(v[addr >> 3] & SHADOW_BIT(addr));
+}
+
+bool SX127x::shadow_hit(uint8_t addr, uint8_t size)
 {
     uint8_t i;
+
+    if (addr == REG_FIFO || addr + size > 0x80)
+        return false;
+
+    for (i = addr; i < addr + size; i++) {
+        if (!shadow_cacheable(i) || !(shadow_valid[i >> 3] & SHADOW_BIT(i)))
+            return false;
+    }
+    return true;
+}
+
+void SX127x::shadow_store(uint8_t addr, const uint8_t* buffer, uint8_t size)
+{
+    uint8_t i;
+
+    if (addr == REG_FIFO)
+        return;
+
+    for (i = 0; i < size && addr + i < 0x80; i++) {
+        uint8_t a = addr + i;
+        if (a == REG_OPMODE) {
+            /* LongRangeMode and AccessSharedReg select which register page is at 0x0d->0x3f */
+            bool fsk = !(buffer[i] & 0x80) || (buffer[i] & 0x40);
+            if (fsk != fsk_page) {
+                uint8_t r;
+                for (r = 0; r < 0x80; r++) {
+                    if (PAGED_REG(r)) {
+                        shadow_valid[r >> 3] &= ~SHADOW_BIT(r);
+                        shadow_dirty[r >> 3] &= ~SHADOW_BIT(r);
+                    }
+                }
+                fsk_page = fsk;
+            }
+        } else if (shadow_cacheable(a)) {
+            shadow[a] = buffer[i];
+            shadow_valid[a >> 3] |= SHADOW_BIT(a);
+        }
+    }
+}
+
+void SX127x::bus_read(uint8_t addr, uint8_t* buffer, uint8_t size)
+{
+    while (async_busy)
+        ;   // background FIFO transfer holds the bus
+
+    select();
     
-    m_cs = 0;
+    m_hal.transfer(addr); // bit7 is low for reading from radio
+
+    m_hal.transfer(NULL, buffer, size);
     
-    m_spi.write(addr); // bit7 is low for reading from radio
+    deselect();
+}
 
-    for( i = 0; i < size; i++ )
-    {
-        buffer[i] = m_spi.write(0x00);
+void SX127x::bus_write(uint8_t addr, const uint8_t* buffer, uint8_t size)
+{
+    while (async_busy)
+        ;   // background FIFO transfer holds the bus
+
+    select();   // Select the device by seting chip select low
+
+    m_hal.transfer(addr | 0x80); // bit7 is high for writing to radio
+    m_hal.transfer(buffer, NULL, size);
+
+    deselect();   // Deselect the device
+}
+
+void
+SX127x::ReadBuffer( uint8_t addr, uint8_t *buffer, uint8_t size )
+{
+    SX127X_COUNT_XACT();
+    if (shadow_hit(addr, size)) {
+        memcpy(buffer, &shadow[addr], size);
+        return;
     }
-    
-    m_cs = 1;
+
+    bus_read(addr, buffer, size);
+    shadow_store(addr, buffer, size);
 }
 
 uint8_t SX127x::read_reg(uint8_t addr)
 {
     uint8_t ret;
-    // Select the device by seting chip select low
-    m_cs = 0;
-
-    m_spi.write(addr); // bit7 is low for reading from radio
- 
-    // Send a dummy byte to receive the contents of register
-    ret = m_spi.write(0x00);
- 
-    // Deselect the device
-    m_cs = 1;
+
+    ReadBuffer(addr, &ret, 1);
     
     return ret;
 }
 
 int16_t SX127x::read_s16(uint8_t addr)
 {
-    int16_t ret;
-    // Select the device by seting chip select low
-    m_cs = 0;
-
-    m_spi.write(addr); // bit7 is low for reading from radio
- 
-    // Send a dummy byte to receive the contents of register
-    ret = m_spi.write(0x00);
-    ret <<= 8;
-    ret += m_spi.write(0x00);
- 
-    // Deselect the device
-    m_cs = 1;
-    
-    return ret;
+    return read_u16(addr);
 }
 
 uint16_t SX127x::read_u16(uint8_t addr)
 {
-    uint16_t ret;
-    // Select the device by seting chip select low
-    m_cs = 0;
-
-    m_spi.write(addr); // bit7 is low for reading from radio
- 
-    // Send a dummy byte to receive the contents of register
-    ret = m_spi.write(0x00);
-    ret <<= 8;
-    ret += m_spi.write(0x00);
- 
-    // Deselect the device
-    m_cs = 1;
-    
-    return ret;
+    uint8_t buf[2];
+
+    ReadBuffer(addr, buf, 2);
+
+    return (buf[0] << 8) | buf[1];
 }
 
 void SX127x::write_u16(uint8_t addr, uint16_t data)
 {
-    m_cs = 0;   // Select the device by seting chip select low
+    uint8_t buf[2];
 
-    m_spi.write(addr | 0x80); // bit7 is high for writing to radio
-    m_spi.write((data >> 8) & 0xff);
-    m_spi.write(data & 0xff);
- 
-    m_cs = 1;   // Deselect the device
+    buf[0] = (data >> 8) & 0xff;
+    buf[1] = data & 0xff;
+    WriteBuffer(addr, buf, 2);
 }
 
 void SX127x::write_u24(uint8_t addr, uint32_t data)
 {
-    m_cs = 0;   // Select the device by seting chip select low
+    uint8_t buf[3];
 
-    m_spi.write(addr | 0x80); // bit7 is high for writing to radio
-    m_spi.write((data >> 16) & 0xff);
-    m_spi.write((data >> 8) & 0xff);
-    m_spi.write(data & 0xff);
- 
-    m_cs = 1;   // Deselect the device
+    buf[0] = (data >> 16) & 0xff;
+    buf[1] = (data >> 8) & 0xff;
+    buf[2] = data & 0xff;
+    WriteBuffer(addr, buf, 3);
     
-    if (addr == REG_FRFMSB) {
-        if (data < 0x8340000)   // < 525MHz
-            HF = false;
-        else
-            HF = true;
-    }
+    if (addr == REG_FRFMSB)
+        HF = data >= FRF_HF_MIN;
 }
 
 void SX127x::write_reg(uint8_t addr, uint8_t data)
 {
-    m_cs = 0;   // Select the device by seting chip select low
-
-    m_spi.write(addr | 0x80); // bit7 is high for writing to radio
-    m_spi.write(data);
- 
-    m_cs = 1;   // Deselect the device
+    WriteBuffer(addr, &data, 1);
 }
 
-void SX127x::WriteBuffer( uint8_t addr, uint8_t *buffer, uint8_t size )
+void SX127x::WriteBuffer( uint8_t addr, const uint8_t *buffer, uint8_t size )
 {
     uint8_t i;
 
-    m_cs = 0;   // Select the device by seting chip select low
+    SX127X_COUNT_XACT();
+
+    if (shadow_hit(addr, size) && memcmp(&shadow[addr], buffer, size) == 0)
+        return; // radio already holds these values
+
+    if (xact_depth > 0 && addr != REG_FIFO && addr + size <= 0x80) {
+        for (i = addr; i < addr + size; i++) {
+            if (!shadow_cacheable(i))
+                break;
+        }
+        if (i == addr + size) {
+            for (i = 0; i < size; i++)
+                stage_reg(addr + i, buffer[i]);
+            return;
+        }
+    }
+
+    flush();    // staged writes go out first, in order
+
+    bus_write(addr, buffer, size);
+    shadow_store(addr, buffer, size);
+}
+
+void SX127x::transfer_async(const uint8_t* tx, uint8_t* rx, int len, Callback<void()> done)
+{
+    async_busy = true;
+    async_done = done;
+    m_hal.transfer_async(tx, rx, len, callback(this, &SX127x::async_complete));
+}
+
+void SX127x::select()
+{
+    bus_busy = true;
+    m_hal.select(true);
+}
 
-    m_spi.write(addr | 0x80); // bit7 is high for writing to radio
-    for( i = 0; i < size; i++ )
-    {
-        m_spi.write(buffer[i]);
+void SX127x::deselect()
+{
+    m_hal.select(false);
+    bus_busy = false;
+    if (bus_work_pending) {
+        bus_work_pending = false;
+        bus_work.call();
     }
+}
 
-    m_cs = 1;   // Deselect the device
+void SX127x::bus_isr(Callback<void()> fn)
+{
+    if (bus_busy) {
+        bus_work = fn;
+        bus_work_pending = true;
+    } else
+        fn.call();
+}
+
+void SX127x::write_now(uint8_t addr, const uint8_t* buffer, uint8_t size)
+{
+    bus_write(addr, buffer, size);
+    if (addr != REG_FIFO)
+        shadow_store(addr, buffer, size);
+}
+
+void SX127x::dio0_isr()
+{
+    SX127x_dio_event ev;
+    ev.dio = 0;
+    ev.t_us = m_hal.now_us();
+    dio_events.push(ev);
+}
+
+void SX127x::dio1_isr()
+{
+    SX127x_dio_event ev;
+
+    if (dio1_fast) {
+        dio1_fast.call();
+        return;
+    }
+
+    ev.dio = 1;
+    ev.t_us = m_hal.now_us();
+    dio_events.push(ev);
+}
+
+void SX127x::dio1_fall_isr()
+{
+    SX127x_dio_event ev;
+    ev.dio = 1 + SX127X_DIO_FALL;
+    ev.t_us = m_hal.now_us();
+    dio_events.push(ev);
+}
+
+void SX127x::dio3_isr()
+{
+    SX127x_dio_event ev;
+    ev.dio = 3;
+    ev.t_us = m_hal.now_us();
+    dio_events.push(ev);
+}
+
+bool SX127x::enable_dio_irq()
+{
+    if (!m_hal.attach_dio(0, callback(this, &SX127x::dio0_isr)))
+        return false;
+    dio_irq = 1 << 0;
+    if (m_hal.attach_dio(1, callback(this, &SX127x::dio1_isr)))
+        dio_irq |= 1 << 1;
+    if (m_hal.attach_dio(3, callback(this, &SX127x::dio3_isr)))
+        dio_irq |= 1 << 3;
+
+    /* already asserted before attach: no edge will come */
+    if (m_hal.dio(0))
+        dio0_isr();
+    if ((dio_irq & (1 << 1)) && m_hal.dio(1))
+        dio1_isr();
+    if ((dio_irq & (1 << 3)) && m_hal.dio(3))
+        dio3_isr();
+
+    return true;
+}
+
+bool SX127x::dio_pending(uint8_t n)
+{
+    uint8_t bit = 1 << n;
+
+    if (!(dio_irq & bit)) {
+        if (!m_hal.dio(n))
+            return false;
+        dio_time_us[n] = m_hal.now_us();
+        return true;
+    }
+
+    dio_drain();
+
+    if (!(dio_flags & bit))
+        return false;
+    dio_flags &= ~bit;
+    return true;
+}
+
+void SX127x::dio_drain()
+{
+    SX127x_dio_event ev;
+
+    while (dio_events.pop(ev)) {
+        dio_flags |= 1 << ev.dio;
+        if (ev.dio < SX127X_DIO_FALL)
+            dio_time_us[ev.dio] = ev.t_us;
+    }
+}
+
+bool SX127x::watch_dio1_fall(bool on)
+{
+    const uint8_t bit = 1 << (1 + SX127X_DIO_FALL);
+
+    dio_drain();
+    dio_flags &= ~bit;  // edge from before is stale
+
+    if (!on || !(dio_irq & (1 << 1))) {
+        if (dio_irq & bit)
+            m_hal.attach_dio_fall(1, Callback<void()>());
+        dio_irq &= ~bit;
+        return false;
+    }
+
+    if (!(dio_irq & bit)) {
+        if (!m_hal.attach_dio_fall(1, callback(this, &SX127x::dio1_fall_isr)))
+            return false;
+        dio_irq |= bit;
+    }
+
+    /* already low before attach: no edge will come */
+    if (!m_hal.dio(1))
+        dio1_fall_isr();
+
+    return true;
+}
+
+bool SX127x::dio1_fall_pending()
+{
+    const uint8_t bit = 1 << (1 + SX127X_DIO_FALL);
+
+    if (!(dio_irq & bit))
+        return !m_hal.dio(1);
+
+    dio_drain();
+
+    if (!(dio_flags & bit))
+        return false;
+    dio_flags &= ~bit;
+    return true;
+}
+
+void SX127x::async_complete()
+{
+    async_busy = false;     // before deselect(): deferred bus work writes synchronously
+    deselect();
+    if (async_done)
+        async_done.call();
+}
+
+void SX127x::WriteBufferAsync(uint8_t addr, const uint8_t* buffer, uint8_t size, Callback<void()> done)
+{
+    SX127X_COUNT_XACT();
+    flush();
+    while (async_busy)
+        ;
+
+    select();
+    m_hal.transfer(addr | 0x80); // bit7 is high for writing to radio
+    transfer_async(buffer, NULL, size, done);
+}
+
+void SX127x::ReadBufferAsync(uint8_t addr, uint8_t* buffer, uint8_t size, Callback<void()> done)
+{
+    SX127X_COUNT_XACT();
+    flush();
+    while (async_busy)
+        ;
+
+    select();
+    m_hal.transfer(addr); // bit7 is low for reading from radio
+    transfer_async(NULL, buffer, size, done);
+}
+
+void SX127x::stage_reg(uint8_t addr, uint8_t data)
+{
+    if (addr == REG_FIFO || !shadow_cacheable(addr)) {
+        write_reg(addr, data);
+        return;
+    }
+
+    if (shadow_hit(addr, 1) && shadow[addr] == data)
+        return;
+
+    shadow[addr] = data;
+    shadow_valid[addr >> 3] |= SHADOW_BIT(addr);
+    shadow_dirty[addr >> 3] |= SHADOW_BIT(addr);
+    shadow_pending = true;
+}
+
+/* a gap this small between dirty registers is cheaper to rewrite (from shadow)
+ * than to start another burst with its own address byte and chip-select cycle */
+#define FLUSH_MAX_GAP   2
+
+void SX127x::flush()
+{
+    uint8_t a, start, end, gap;
+
+    if (!shadow_pending)
+        return;
+
+    SX127X_PROBE(flush, m_hal);
+    shadow_pending = false;
+
+    for (a = 0; a < 0x80; a++) {
+        if (!(shadow_dirty[a >> 3] & SHADOW_BIT(a)))
+            continue;
+
+        /* extend burst over following dirty registers, bridging small clean gaps */
+        start = a;
+        end = a;
+        for (a = start + 1; a < 0x80; a++) {
+            if (shadow_dirty[a >> 3] & SHADOW_BIT(a)) {
+                end = a;
+                continue;
+            }
+            gap = a - end;
+            if (gap > FLUSH_MAX_GAP || !shadow_hit(a, 1))
+                break;
+        }
+
+        for (a = start; a <= end; a++)
+            shadow_dirty[a >> 3] &= ~SHADOW_BIT(a);
+        bus_write(start, &shadow[start], end - start + 1);
+        a = end;
+    }
+}
+
+void SX127x::begin_transaction()
+{
+    xact_depth++;
+}
+
+void SX127x::end_transaction()
+{
+    if (xact_depth > 0 && --xact_depth == 0)
+        flush();
 }
 
 void SX127x::set_opmode(chip_mode_e mode)
 {
+    SX127X_PROBE(set_opmode, m_hal);
     RegOpMode.bits.Mode = mode;
     
     // callback to control antenna switch and PaSelect (PABOOST/RFO) for TX
@@ -221,53 +562,35 @@ void SX127x::set_opmode(chip_mode_e mode)
 
 void SX127x::set_frf_MHz( float MHz )
 {
-    uint32_t frf;
-    
-    frf = MHz / (float)FREQ_STEP_MHZ;
-    write_u24(REG_FRFMSB, frf);
-    
-    if (MHz < 525)
-        HF = false;
-    else
-        HF = true;
+    SX127X_PROBE(set_frf_MHz, m_hal);
+    set_frf_hz((uint32_t)(MHz * 1e6f + 0.5f));
 }
 
 float SX127x::get_frf_MHz(void)
 {
+    return get_frf_hz() / 1000000.0f;
+}
+
+void SX127x::set_frf_hz(uint32_t hz)
+{
+    write_u24(REG_FRFMSB, sx127x_hz_to_frf(hz));
+}
+
+uint32_t SX127x::get_frf_hz(void)
+{
+    uint8_t buf[3];
     uint32_t frf;
-    uint8_t lsb, mid, msb;
-    float MHz;
-    
-    msb = read_reg(REG_FRFMSB);
-    mid = read_reg(REG_FRFMID);
-    lsb = read_reg(REG_FRFLSB);
-    frf = msb;
-    frf <<= 8;
-    frf += mid;
-    frf <<= 8;
-    frf += lsb;
-    
-    MHz = frf * FREQ_STEP_MHZ;
-    
-    if (MHz < 525)
-        HF = false;
-    else
-        HF = true;
-        
-    return MHz;
+
+    ReadBuffer(REG_FRFMSB, buf, 3);
+    frf = ((uint32_t)buf[0] << 16) | (buf[1] << 8) | buf[2];
+    HF = frf >= FRF_HF_MIN;
+
+    return sx127x_frf_to_hz(frf);
 }
 
 void SX127x::hw_reset()
 {
-    int in = reset_pin.read();
-    reset_pin.output();
-    reset_pin.write(1);
-    wait(0.05);    
-    if (in == 1) { /* pin is pulled up somewhere? */
-        reset_pin.write(0);
-        wait(0.005);
-    }
-    reset_pin.input();
-    wait(0.005);
+    SX127X_PROBE(hw_reset, m_hal);
+    m_hal.hw_reset();
+    shadow_invalidate();
 }
-
@@ -17,7 +17,15 @@
 #ifndef SX127x_H
 #define SX127x_H
 
+#ifdef SX127X_HOST
+#include "sx127x_host.h"
+#else
 #include "mbed.h"
+#endif
+#include "sx127x_hal.h"
+#include "sx127x_events.h"
+#include "sx127x_instr.h"
+#include "sx127x_fixed.h"
 
 #define XTAL_FREQ   32000000
 
@@ -27,6 +35,8 @@
 
 #define MHZ_TO_FRF(m)   (m / FREQ_STEP_MHZ)
 
+#define FRF_HF_MIN      0x834000    // 525MHz: sx1276 band 1 (HF port) from here up
+
 /******************************************************************************/
 /*!
  * SX127x Internal registers Address
@@ -82,7 +92,17 @@ typedef enum {
     //! request to call read_fifo()
     SERVICE_READ_FIFO,
     //! notification to application of transmit complete
-    SERVICE_TX_DONE
+    SERVICE_TX_DONE,
+    //! channel activity detection finished, result in RegIrqFlags.bits.CadDetected
+    SERVICE_CAD_DONE,
+    //! listen-before-talk gave up: channel busy on every attempt, payload still in FIFO
+    SERVICE_CHANNEL_BUSY,
+    //! RX_SINGLE found no preamble within symbol timeout, radio back in standby
+    SERVICE_RX_TIMEOUT,
+    //! header rejected by filter, packet abandoned: receiving again (RX_SINGLE: standby, sniff: asleep)
+    SERVICE_RX_ABORTED,
+    //! packet still arriving, first rx_streamed payload bytes already in rx_dest
+    SERVICE_RX_PARTIAL
 } service_action_e;
 
 /******************************************************************************/
@@ -207,6 +227,7 @@ typedef union {
 
 class SX127x {
     public:
+#ifndef SX127X_HOST
             /** Create SX127x instance
          * @param mosi SPI master-out pin
          * @param miso SPI master-in pin
@@ -218,7 +239,13 @@ class SX127x {
          * @param fem_cps rx-tx switch for LF bands (vhf/433)
          */
          
-        SX127x(PinName dio0, PinName dio_1, PinName cs, SPI&, PinName rst);
+        SX127x(PinName dio0, PinName dio_1, PinName cs, SPI&, PinName rst, PinName dio_3 = NC);
+#endif
+
+        /** Create SX127x instance on caller-provided bus/pin access
+         * @param hal bus backend, must outlive this instance
+         */
+        SX127x(SX127x_hal& hal);
         
         ~SX127x();
         
@@ -232,6 +259,16 @@ class SX127x {
          */
         float get_frf_MHz(void);
 
+        /** set center operating frequency, integer only
+         * @param hz operating frequency in Hz
+         */
+        void set_frf_hz(uint32_t hz);
+
+        /** get center operating frequency, integer only
+         * @returns operating frequency in Hz, truncated to synthesizer step
+         */
+        uint32_t get_frf_hz(void);
+
         void set_opmode(chip_mode_e mode);
         
         /** reset radio using pin
@@ -271,18 +308,123 @@ class SX127x {
          * @param buffer byte(s) to write
          * @param size count of registers to write to
          */
-        void WriteBuffer( uint8_t addr, uint8_t *buffer, uint8_t size );
+        void WriteBuffer( uint8_t addr, const uint8_t *buffer, uint8_t size );
+
+        /** start FIFO write and return before it completes (DMA where the bus backend supports it)
+         * @param addr register address, normally REG_FIFO: the shadow is bypassed
+         * @param buffer byte(s) to write, must stay valid until done
+         * @param size count of registers to write to
+         * @param done called once transfer complete and radio deselected, possibly from interrupt context
+         * @note other register access waits until the transfer completes
+         */
+        void WriteBufferAsync(uint8_t addr, const uint8_t* buffer, uint8_t size, Callback<void()> done);
+
+        /** start FIFO read and return before it completes, see WriteBufferAsync() */
+        void ReadBufferAsync(uint8_t addr, uint8_t* buffer, uint8_t size, Callback<void()> done);
+
+        /** continue current selected transaction in background, radio deselected on completion */
+        void transfer_async(const uint8_t* tx, uint8_t* rx, int len, Callback<void()> done);
+
+        /** chip select for one register/FIFO transaction, for modem classes which
+         * clock bytes through m_hal directly.  Work passed to bus_isr() meanwhile
+         * runs at deselect(). */
+        void select(void);
+        void deselect(void);
+
+        /** register access from interrupt context: run fn now if no transaction is
+         * in progress, otherwise as soon as it ends.  fn should use write_now().
+         * @param fn called in interrupt context or at end of interrupted transaction
+         */
+        void bus_isr(Callback<void()> fn);
+
+        /** write register(s) immediately, bypassing any open transaction
+         * @param addr register address
+         * @param buffer byte(s) to write
+         * @param size count of registers to write to
+         */
+        void write_now(uint8_t addr, const uint8_t* buffer, uint8_t size);
+
+        /** @returns true while background transfer in progress */
+        bool async_pending(void) { return async_busy; }
+
+        /** update register in shadow only, to be written to radio on flush()
+         * @param addr register address
+         * @param data value
+         * @note FIFO and status registers are written immediately
+         */
+        void stage_reg(uint8_t addr, uint8_t data);
+
+        /** write all staged registers to radio */
+        void flush(void);
+
+        /** start collecting register writes.  Until the matching end_transaction(),
+         * writes to non-volatile registers are staged and then flushed as
+         * the fewest contiguous bursts.  Transactions may be nested.
+         */
+        void begin_transaction(void);
+
+        /** end transaction, outermost end writes the staged registers to radio */
+        void end_transaction(void);
+
+        /** forget shadow contents, next read of each register goes to radio
+         * @note needed only if radio registers were changed behind the driver's back
+         */
+        void shadow_invalidate(void);
+        
+        /** take DIO0, DIO1 and (where wired) DIO3 from interrupts instead of polling.  Each rising edge is
+         * timestamped and queued in dio_events; service() then touches the bus only when
+         * an edge is queued, so the application may sleep while dio_events is empty.
+         * @note all DIO interrupts push to the one dio_events queue: they must run at the same
+         *       priority so that none preempts another (mbed default for InterruptIn)
+         * @returns false if the HAL has no interrupt on DIO0: polling remains in use
+         */
+        bool enable_dio_irq(void);
+
+        /** bottom half: consume DIO n signal.
+         * Interrupt mode drains dio_events and reports a queued edge, polled mode reads the pin.
+         * @param n DIO number, 0 to 3
+         * @returns true if DIO n was signalled, dio_time_us[n] holds when
+         */
+        bool dio_pending(uint8_t n);
+
+        /** also take falling edges of DIO1 from interrupt, for level signals such as FSK FifoLevel
+         * which need service when they drop.  Detach when done: every flag clear is a falling edge.
+         * @param on attach or detach
+         * @returns true if interrupt-driven, false if dio1_fall_pending() polls the pin
+         */
+        bool watch_dio1_fall(bool on);
+
+        /** bottom half: consume DIO1 falling edge (interrupt mode) or pin found low (polled mode) */
+        bool dio1_fall_pending(void);
+
+        //! DIO edges from interrupt, drained by dio_pending().  Single producer: DIO ISRs must not nest
+        SX127x_event_queue<8> dio_events;
+
+        //! time of last DIO edge (interrupt mode) or of detecting it (polled mode)
+        uint32_t dio_time_us[4];
+
+        /*! in interrupt mode, DIO1 edges call this directly in interrupt context
+         * instead of being queued, for work with a hard deadline such as frequency hopping */
+        Callback<void()> dio1_fast;
         
         /* *switch between FSK or LoRa modes */
         //void SetLoRaOn(bool);
         
         /*****************************************************/
         
+#ifndef SX127X_NO_PKT_BUFS
         //! RF transmit packet buffer
         uint8_t tx_buf[256];    // lora fifo size
         
         //! RF receive packet buffer
         uint8_t rx_buf[256];    // lora fifo size
+#endif
+
+        /*! where service() puts received packets: rx_buf[] by default, or a caller-owned
+         * buffer of 256 bytes.  NULL leaves the packet in the radio for read_fifo(buf, len),
+         * which is the default when built with SX127X_NO_PKT_BUFS.
+         */
+        uint8_t* rx_dest;
        
         //! radio chip type plugged in
         type_e type;
@@ -304,10 +446,8 @@ class SX127x {
         //! pin assignments
         RegDioMapping2_t RegDioMapping2;
                
-        DigitalIn dio0;
-        DigitalIn dio1;
-        DigitalOut m_cs;
-        SPI& m_spi;
+        //! SPI bus, DIO pins and clock
+        SX127x_hal& m_hal;
         bool HF;    // sx1272 is always HF   
 
         /*! board-specific RF switch callback, called whenever operating mode is changed
@@ -319,7 +459,38 @@ class SX127x {
         Callback<void()> rf_switch;
          
     private:    
-        DigitalInOut reset_pin;        
+        bool owns_hal;
+
+        /* shadow of registers 0x00->0x7f, written-through.  Paged registers
+         * (0x02->0x05, 0x0d->0x3f) are dropped when LoRa/FSK page changes. */
+        uint8_t shadow[0x80];
+        uint8_t shadow_valid[16];   // bitmap: shadow holds radio's value
+        uint8_t shadow_dirty[16];   // bitmap: staged, not yet written to radio
+        bool shadow_pending;        // any bit set in shadow_dirty
+        bool fsk_page;
+        uint8_t xact_depth;         // begin_transaction() nesting
+
+        uint8_t dio_irq;            // bitmap: DIOs attached by enable_dio_irq() (falling: bit n + SX127X_DIO_FALL), others polled
+        uint8_t dio_flags;          // bitmap: edges drained from dio_events, not yet consumed
+        void dio0_isr(void);
+        void dio1_isr(void);
+        void dio3_isr(void);
+        void dio1_fall_isr(void);
+        void dio_drain(void);
+
+        volatile bool bus_busy;         // chip selected
+        volatile bool bus_work_pending; // bus_isr() deferred until deselect()
+        Callback<void()> bus_work;
+
+        volatile bool async_busy;
+        Callback<void()> async_done;
+        void async_complete(void);
+
+        bool shadow_cacheable(uint8_t addr);
+        bool shadow_hit(uint8_t addr, uint8_t size);
+        void shadow_store(uint8_t addr, const uint8_t* buffer, uint8_t size);
+        void bus_read(uint8_t addr, uint8_t* buffer, uint8_t size);
+        void bus_write(uint8_t addr, const uint8_t* buffer, uint8_t size);
         
     protected:
         
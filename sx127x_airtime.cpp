@@ -0,0 +1,30 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sx127x_airtime.h"
+
+/* constant-initialized under C++11: the table is in flash, nothing runs at startup */
+#define AIRTIME(sf, bw, cr) \
+    SX127x_lora_airtime(sf, bw, cr, LORA_AIRTIME_PREAMBLE, true, false, lora_ldro_needed(sf, bw))
+#define AIRTIME_CR(sf, bw) \
+    { AIRTIME(sf, bw, 1), AIRTIME(sf, bw, 2), AIRTIME(sf, bw, 3), AIRTIME(sf, bw, 4) }
+#define AIRTIME_BW(sf) { \
+    AIRTIME_CR(sf, 0), AIRTIME_CR(sf, 1), AIRTIME_CR(sf, 2), AIRTIME_CR(sf, 3), AIRTIME_CR(sf, 4), \
+    AIRTIME_CR(sf, 5), AIRTIME_CR(sf, 6), AIRTIME_CR(sf, 7), AIRTIME_CR(sf, 8), AIRTIME_CR(sf, 9) }
+
+const SX127x_lora_airtime lora_airtime_table[7][10][4] = {
+    AIRTIME_BW(6), AIRTIME_BW(7), AIRTIME_BW(8), AIRTIME_BW(9), AIRTIME_BW(10), AIRTIME_BW(11), AIRTIME_BW(12)
+};
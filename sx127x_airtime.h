@@ -0,0 +1,115 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_AIRTIME_H
+#define SX127x_AIRTIME_H
+
+#include <stdint.h>
+#include "sx127x_fixed.h"
+
+/* LoRa time on air, exact integer microseconds.
+ * Every bandwidth is 500KHz divided by an integer (7.8KHz = 500/64), so a symbol
+ * lasts 2^SF * 2 * divisor microseconds with no rounding (see lora_bw_div()).
+ * Usable in constant expressions when compiled as C++11. */
+
+/** @returns symbol duration in microseconds
+ * @param sf spreading factor 6 to 12
+ * @param bw SX1276 Bw index, see lora_bw_div() */
+SX127X_CONSTEXPR uint32_t lora_symbol_us(uint8_t sf, uint8_t bw)
+{
+    return ((uint32_t)2 << sf) * lora_bw_div(bw);
+}
+
+/** @returns true where LowDataRateOptimize is mandated: symbol longer than 16ms */
+SX127X_CONSTEXPR bool lora_ldro_needed(uint8_t sf, uint8_t bw)
+{
+    return lora_symbol_us(sf, bw) > 16000;
+}
+
+/** precomputed airtime of one modem configuration, payload length supplied per packet.
+ * lora_airtime_table holds one for each SF/BW/CR, constant-initialized under C++11;
+ * us(len) costs a division and a multiply.
+ */
+class SX127x_lora_airtime {
+    public:
+        /**
+         * @param sf spreading factor 6 to 12
+         * @param bw SX1276 Bw index, see lora_bw_div()
+         * @param cr coding rate 1=4/5 ... 4=4/8
+         * @param preamble RegPreamble, symbols programmed (4.25 are added by the modem)
+         * @param crc payload CRC on
+         * @param implicit implicit header mode
+         * @param ldro LowDataRateOptimize
+         */
+        SX127X_CONSTEXPR SX127x_lora_airtime(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble, bool crc, bool implicit, bool ldro) :
+            sym_q_us(((uint32_t)1 << (sf - 1)) * lora_bw_div(bw)),
+            fixed_q((uint32_t)preamble * 4 + 17 + 8 * 4),
+            bits_base(28 - 4 * sf + (crc ? 16 : 0) - (implicit ? 20 : 0)),
+            block_bits(4 * (sf - (ldro ? 2 : 0))),
+            block_syms(cr + 4)
+        { }
+
+        /** @returns payload and header symbols, preamble excluded */
+        SX127X_CONSTEXPR uint16_t payload_symbols(uint8_t len) const
+        {
+            return 8 + blocks(8 * len + bits_base) * block_syms;
+        }
+
+        /** @returns time on air of len byte payload, preamble included */
+        SX127X_CONSTEXPR uint32_t us(uint8_t len) const
+        {
+            return (uint32_t)((fixed_q + (uint64_t)4 * blocks(8 * len + bits_base) * block_syms) * sym_q_us);
+        }
+
+        /** @returns symbol duration in microseconds */
+        SX127X_CONSTEXPR uint32_t symbol_us(void) const { return sym_q_us * 4; }
+
+    private:
+        SX127X_CONSTEXPR uint16_t blocks(int bits) const
+        {
+            return bits > 0 ? (bits + block_bits - 1) / block_bits : 0;
+        }
+
+        uint32_t sym_q_us;      // quarter symbol
+        uint32_t fixed_q;       // preamble + 4.25 sync + 8 symbols, in quarter symbols
+        int16_t bits_base;      // payload bits excluding 8*len
+        uint8_t block_bits;     // bits carried per coding block
+        uint8_t block_syms;     // symbols per coding block
+};
+
+/** @returns LoRa time on air in microseconds, see SX127x_lora_airtime for parameters */
+SX127X_CONSTEXPR uint32_t lora_airtime_us(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble, uint8_t len, bool crc, bool implicit, bool ldro)
+{
+    return SX127x_lora_airtime(sf, bw, cr, preamble, crc, implicit, ldro).us(len);
+}
+
+#define LORA_AIRTIME_PREAMBLE   8   // RegPreamble of lora_airtime_table, radio's reset value
+
+/*! every SF (6 to 12), SX1276 Bw index (0 to 9) and CR (4/5 to 4/8) with the usual packet
+ * settings: LORA_AIRTIME_PREAMBLE, explicit header, payload CRC on, LowDataRateOptimize
+ * where lora_ldro_needed().  Other settings: construct SX127x_lora_airtime directly. */
+extern const SX127x_lora_airtime lora_airtime_table[7][10][4];
+
+/** @returns lora_airtime_table entry
+ * @param sf spreading factor 6 to 12
+ * @param bw SX1276 Bw index, see lora_bw_div()
+ * @param cr coding rate 1=4/5 ... 4=4/8 */
+inline const SX127x_lora_airtime& lora_airtime_lookup(uint8_t sf, uint8_t bw, uint8_t cr)
+{
+    return lora_airtime_table[sf - 6][bw][cr - 1];
+}
+
+#endif /* SX127x_AIRTIME_H */
@@ -0,0 +1,51 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_CALLBACK_H
+#define SX127x_CALLBACK_H
+
+#ifdef SX127X_HOST
+
+#include <functional>
+
+/** stand-in for mbed Callback<> on host builds */
+template <typename F> class Callback;
+
+template <typename R, typename... A>
+class Callback<R(A...)> {
+    public:
+        Callback() { }
+        Callback(R (*fn)(A...)) : f(fn) { }
+        template <typename T>
+        Callback(T* obj, R (T::*method)(A...)) : f([obj, method](A... a) { return (obj->*method)(a...); }) { }
+
+        operator bool() const { return static_cast<bool>(f); }
+        R call(A... a) const { return f(a...); }
+        R operator()(A... a) const { return f(a...); }
+
+    private:
+        std::function<R(A...)> f;
+};
+
+template <typename T, typename R, typename... A>
+Callback<R(A...)> callback(T* obj, R (T::*method)(A...))
+{
+    return Callback<R(A...)>(obj, method);
+}
+
+#endif /* SX127X_HOST */
+
+#endif /* SX127x_CALLBACK_H */
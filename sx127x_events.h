@@ -0,0 +1,169 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_EVENTS_H
+#define SX127x_EVENTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef SX127X_HOST
+#define SX127X_DMB()    __sync_synchronize()
+#else
+#include "mbed.h"
+#define SX127X_DMB()    __DMB()
+#endif
+
+#define SX127X_DIO_FALL     4   // SX127x_dio_event.dio of a falling edge: DIO number + 4
+
+/** one DIO edge, captured in interrupt context */
+struct SX127x_dio_event {
+    uint8_t dio;        // DIO number, + SX127X_DIO_FALL for falling edge
+    uint32_t t_us;      // SX127x_hal::now_us() at the edge
+};
+
+/** lock-free single producer (ISR) / single consumer (bottom half) ring.
+ * N must be a power of two, at most 128.  One slot is never used, so N-1 events fit.
+ * Several ISRs may share a queue only if they can't preempt each other (same priority):
+ * push() is not reentrant.
+ */
+template <unsigned N>
+class SX127x_event_queue {
+    typedef char n_is_power_of_two[((N & (N - 1)) == 0 && N <= 128) ? 1 : -1];
+
+    public:
+        SX127x_event_queue() : dropped(0), head(0), tail(0) { }
+
+        /** producer side, call only from the ISR
+         * @returns false if queue full, event counted in dropped
+         */
+        bool push(const SX127x_dio_event& ev)
+        {
+            uint8_t h = head;
+            uint8_t next = (h + 1) & (N - 1);
+            if (next == tail) {
+                dropped++;
+                return false;
+            }
+            buf[h] = ev;
+            SX127X_DMB();   // slot contents visible before index
+            head = next;
+            return true;
+        }
+
+        /** consumer side, call only from the bottom half
+         * @returns false if queue empty
+         */
+        bool pop(SX127x_dio_event& ev)
+        {
+            uint8_t t = tail;
+            if (t == head)
+                return false;
+            SX127X_DMB();   // index read before slot contents
+            ev = buf[t];
+            SX127X_DMB();   // slot read before releasing it
+            tail = (t + 1) & (N - 1);
+            return true;
+        }
+
+        bool empty(void) const { return head == tail; }
+
+        //! events lost to a full queue
+        volatile unsigned dropped;
+
+    private:
+        SX127x_dio_event buf[N];
+        volatile uint8_t head;  // written only by producer
+        volatile uint8_t tail;  // written only by consumer
+};
+
+#ifndef SX127X_PKT_MAX
+#define SX127X_PKT_MAX  255     // largest payload a ring slot holds
+#endif
+
+/** received packet with its metadata, one slot of SX127x_pkt_ring */
+struct SX127x_rx_pkt {
+    uint32_t t_us;          // RxDone edge
+    int32_t freq_error_hz;
+    int16_t rssi_dbm;
+    int8_t snr_x4;          // dB * 4
+    uint8_t coding_rate;    // 1=4/5 ... 4=4/8
+    bool crc_ok;
+    uint8_t len;
+    uint8_t payload[SX127X_PKT_MAX];
+};
+
+/** lock-free single producer (service()) / single consumer (application) ring of received packets.
+ * Slots are filled in place: the payload is read from the radio FIFO directly into the slot.
+ * Storage is supplied by the caller, n slots hold n-1 packets.
+ */
+class SX127x_pkt_ring {
+    public:
+        SX127x_pkt_ring(SX127x_rx_pkt* slots, uint8_t n) : dropped(0), m_slots(slots), m_n(n), head(0), tail(0) { }
+
+        /** producer: next free slot, NULL if ring full (counted in dropped) */
+        SX127x_rx_pkt* claim(void)
+        {
+            if (next(head) == tail) {
+                dropped++;
+                return NULL;
+            }
+            return &m_slots[head];
+        }
+
+        /** producer: publish slot returned by claim() */
+        void commit(void)
+        {
+            SX127X_DMB();   // slot contents visible before index
+            head = next(head);
+        }
+
+        /** consumer: oldest packet, NULL if ring empty */
+        SX127x_rx_pkt* front(void)
+        {
+            if (tail == head)
+                return NULL;
+            SX127X_DMB();   // index read before slot contents
+            return &m_slots[tail];
+        }
+
+        /** consumer: done with packet returned by front(), slot may be reused */
+        void release(void)
+        {
+            SX127X_DMB();   // slot read before releasing it
+            tail = next(tail);
+        }
+
+        /** @returns count of packets waiting */
+        uint8_t count(void) const
+        {
+            uint8_t h = head, t = tail;
+            return h >= t ? h - t : m_n - t + h;
+        }
+
+        //! packets lost to full ring or oversized payload
+        volatile unsigned dropped;
+
+    private:
+        uint8_t next(uint8_t i) const { return (i + 1 == m_n) ? 0 : i + 1; }
+
+        SX127x_rx_pkt* const m_slots;
+        const uint8_t m_n;
+        volatile uint8_t head;  // written only by producer
+        volatile uint8_t tail;  // written only by consumer
+};
+
+#endif /* SX127x_EVENTS_H */
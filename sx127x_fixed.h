@@ -0,0 +1,82 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_FIXED_H
+#define SX127x_FIXED_H
+
+#include <stdint.h>
+
+/* integer replacements for the float frequency math, for parts without FPU.
+ * Assumes the 32MHz crystal (XTAL_FREQ): synthesizer step is 32e6 / 2^19 = 15625 / 256 Hz. */
+
+#if __cplusplus >= 201103L
+#define SX127X_CONSTEXPR    constexpr
+#else
+#define SX127X_CONSTEXPR    inline
+#endif
+
+#define FREQ_STEP_NUM   15625   // FREQ_STEP_HZ = FREQ_STEP_NUM / 256
+
+/** @returns synthesizer steps (RegFrf, RegFdev) for hz, truncated; exact over the full 32bit range */
+SX127X_CONSTEXPR uint32_t sx127x_hz_to_frf(uint32_t hz)
+{
+    return ((hz / FREQ_STEP_NUM) << 8) + (((hz % FREQ_STEP_NUM) << 8) / FREQ_STEP_NUM);
+}
+
+/** @returns hertz of synthesizer steps, truncated */
+SX127X_CONSTEXPR uint32_t sx127x_frf_to_hz(uint32_t frf)
+{
+    return (frf >> 8) * FREQ_STEP_NUM + (((frf & 0xff) * FREQ_STEP_NUM) >> 8);
+}
+
+/** RegFrf bytes, MSB first, for hz: initializer of one hop table entry.
+ * static const uint8_t hops[][3] = { SX127X_FRF_BYTES(902300000), SX127X_FRF_BYTES(902500000) }; */
+#define SX127X_FRF_BYTES(hz) \
+    { (uint8_t)(sx127x_hz_to_frf(hz) >> 16), (uint8_t)(sx127x_hz_to_frf(hz) >> 8), (uint8_t)sx127x_hz_to_frf(hz) }
+
+/** LoRa bandwidth, shared by all LoRa bandwidth conversions.
+ * @param bw SX1276 RegModemConfig1 Bw: 0=7.8KHz ... 7=125KHz, 8=250KHz, 9=500KHz
+ * @returns divisor of 500KHz */
+SX127X_CONSTEXPR uint8_t lora_bw_div(uint8_t bw)
+{
+    return bw == 0 ? 64 : bw == 1 ? 48 : bw == 2 ? 32 : bw == 3 ? 24 : bw == 4 ? 16 :
+           bw == 5 ? 12 : bw == 6 ? 8 : bw == 7 ? 4 : bw == 8 ? 2 : 1;
+}
+
+/** @returns LoRa bandwidth in hertz, truncated (7812 for 7.8125KHz) */
+SX127X_CONSTEXPR uint32_t lora_bw_hz(uint8_t bw)
+{
+    return 500000 / lora_bw_div(bw);
+}
+
+/** LoRa receiver frequency error: fei * 2^24 / XTAL_FREQ * bw / 500KHz
+ * @param fei signed 20bit RegFei (0x28->0x2a)
+ * @param bw SX1276 Bw index
+ * @returns hertz, truncated toward zero */
+SX127X_CONSTEXPR int32_t lora_fei_to_hz(int32_t fei, uint8_t bw)
+{
+    return (int32_t)(((int64_t)fei * 8192) / ((int32_t)FREQ_STEP_NUM * lora_bw_div(bw)));
+}
+
+/** FSK/OOK receiver bandwidth, XTAL_FREQ / (mantissa * 2^(exponent + 2)), halved for OOK.
+ * @param i 0 to 23, exponent * 3 + mantissa field: widest (500KHz FSK) first, strictly decreasing
+ * @returns single side bandwidth in hertz, truncated */
+SX127X_CONSTEXPR uint32_t fsk_rx_bw_hz(uint8_t i, bool ook)
+{
+    return 32000000 / ((16 + 4 * (i % 3)) * ((uint32_t)4 << (i / 3)) * (ook ? 2 : 1));
+}
+
+#endif /* SX127x_FIXED_H */
@@ -16,7 +16,7 @@
  * limitations under the License.
  */
 
-SX127x_fsk::SX127x_fsk(SX127x& r) : m_xcvr(r)
+SX127x_fsk::SX127x_fsk(SX127x& r) : tx_ending(false), seq_state(FSK_SEQ_OFF), m_xcvr(r), tx_stream_buf(NULL), tx_left(0), rx_stream_buf(NULL), rx_crc_auto_clear_off(false), bit_period_us(0)
 {
 }
 
@@ -24,31 +24,82 @@ SX127x_fsk::~SX127x_fsk()
 {
 }
 
+#ifndef SX127X_NO_PKT_BUFS
 void SX127x_fsk::write_fifo(uint8_t len)
 {
-    int i;
+    write_fifo(m_xcvr.tx_buf, len);
+}
+
+void SX127x_fsk::write_fifo_async(uint8_t len, Callback<void()> done)
+{
+    write_fifo_async(m_xcvr.tx_buf, len, done);
+}
+
+void SX127x_fsk::start_tx(uint16_t len)
+{
+    start_tx(m_xcvr.tx_buf, len);
+}
+#endif /* !SX127X_NO_PKT_BUFS */
+
+void SX127x_fsk::write_fifo(const uint8_t* buf, uint8_t len)
+{
+    load_fifo(buf, len, (!m_xcvr.RegOpMode.bits.LongRangeMode && RegPktConfig1.bits.PacketFormatVariable) ? len : -1);
+}
+
+/* len bytes into FIFO in one burst, preceded by length byte unless len_byte < 0 */
+void SX127x_fsk::load_fifo(const uint8_t* buf, uint8_t len, int len_byte)
+{
+    SX127X_COUNT_XACT();
+    m_xcvr.flush();
+    while (m_xcvr.async_pending())
+        ;
+
+    m_xcvr.select();
+    m_xcvr.m_hal.transfer(REG_FIFO | 0x80); // bit7 is high for writing to radio
+    
+    if (len_byte >= 0) {
+        m_xcvr.m_hal.transfer(len_byte);
+    }
     
-    m_xcvr.m_cs = 0;
-    m_xcvr.m_spi.write(REG_FIFO | 0x80); // bit7 is high for writing to radio
+    m_xcvr.m_hal.transfer(buf, NULL, len);
+    m_xcvr.deselect();
+}
+
+void SX127x_fsk::write_fifo_async(const uint8_t* buf, uint8_t len, Callback<void()> done)
+{
+    SX127X_COUNT_XACT();
+    m_xcvr.flush();
+    while (m_xcvr.async_pending())
+        ;
+
+    m_xcvr.select();
+    m_xcvr.m_hal.transfer(REG_FIFO | 0x80); // bit7 is high for writing to radio
     
     if (!m_xcvr.RegOpMode.bits.LongRangeMode && RegPktConfig1.bits.PacketFormatVariable) {
-        m_xcvr.m_spi.write(len);
+        m_xcvr.m_hal.transfer(len);
     }
     
-    for (i = 0; i < len; i++) {
-        m_xcvr.m_spi.write(m_xcvr.tx_buf[i]);
-    }
-    m_xcvr.m_cs = 1;
+    m_xcvr.transfer_async(buf, NULL, len, done);
+}
+
+void SX127x_fsk::read_fifo(uint8_t* buf, uint8_t len)
+{
+    m_xcvr.ReadBuffer(REG_FIFO, buf, len);
 }
 
 void SX127x_fsk::enable(bool fast)
 {
+    SX127X_PROBE(fsk_enable, m_xcvr.m_hal);
+    uint16_t bw;
+
     m_xcvr.set_opmode(RF_OPMODE_SLEEP);
     
     m_xcvr.RegOpMode.bits.LongRangeMode = 0;
     m_xcvr.write_reg(REG_OPMODE, m_xcvr.RegOpMode.octet);
-    if (fast)
+    if (fast) {
+        get_bitrate();  // bit_period_us from bitrate radio already has
         return;
+    }
     
     RegPktConfig1.octet = m_xcvr.read_reg(REG_FSK_PACKETCONFIG1);
     RegPktConfig2.word = m_xcvr.read_u16(REG_FSK_PACKETCONFIG2);
@@ -57,6 +108,10 @@ void SX127x_fsk::enable(bool fast)
     RegSyncConfig.octet = m_xcvr.read_reg(REG_FSK_SYNCCONFIG);
     RegFifoThreshold.octet = m_xcvr.read_reg(REG_FSK_FIFOTHRESH);
     RegAfcFei.octet = m_xcvr.read_reg(REG_FSK_AFCFEI);
+    bw = m_xcvr.read_u16(REG_FSK_RXBW);
+    RegRxBw.octet = bw >> 8;
+    RegAfcBw.octet = bw & 0xff;
+    RegTimerResol.octet = m_xcvr.read_reg(REG_FSK_TIMERRESOL);
     
     if (!RegFifoThreshold.bits.TxStartCondition) {
         RegFifoThreshold.bits.TxStartCondition = 1; // start TX on fifoEmpty==0
@@ -78,8 +133,10 @@ void SX127x_fsk::enable(bool fast)
 
 void SX127x_fsk::init()
 {
+    SX127X_PROBE(fsk_init, m_xcvr.m_hal);
     m_xcvr.set_opmode(RF_OPMODE_STANDBY);
     
+    m_xcvr.begin_transaction();
     RegRxConfig.bits.RxTrigger = 6; // have RX restart (trigger) on preamble detection
     RegRxConfig.bits.AfcAutoOn = 1; // have AFC performed on RX restart (RX trigger)
     m_xcvr.write_reg(REG_FSK_RXCONFIG, RegRxConfig.octet);
@@ -96,8 +153,8 @@ void SX127x_fsk::init()
     // in case these were changed from default:
     set_bitrate(4800);
     set_tx_fdev_hz(5050);
-    set_rx_dcc_bw_hz(10500, 0);    // rxbw
-    set_rx_dcc_bw_hz(50000, 1);    // afcbw
+    set_rx_afc_bw_hz(10500, 50000);
+    m_xcvr.end_transaction();
 }
     
 uint32_t SX127x_fsk::get_bitrate()
@@ -107,125 +164,110 @@ uint32_t SX127x_fsk::get_bitrate()
     if (br == 0)
         return 0;
     else {
-        uint32_t bps = XTAL_FREQ / br;
-        bit_period_us = bps / 1000;
-        return bps;
+        bit_period_us = (br + XTAL_FREQ/1000000 - 1) / (XTAL_FREQ/1000000);
+        return XTAL_FREQ / br;
     }
 }
 
 void SX127x_fsk::set_bitrate(uint32_t bps)
 {
+    SX127X_PROBE(fsk_set_bitrate, m_xcvr.m_hal);
     uint16_t tmpBitrate = XTAL_FREQ / bps;
-    bit_period_us = bps / 1000;
+    bit_period_us = (tmpBitrate + XTAL_FREQ/1000000 - 1) / (XTAL_FREQ/1000000);   // one bit is tmpBitrate xtal cycles
     //printf("tmpBitrate:%d = %d / %d\r\n", tmpBitrate, XTAL_FREQ, bps);
     m_xcvr.write_u16(REG_FSK_BITRATEMSB, tmpBitrate);
 }
 
 void SX127x_fsk::set_tx_fdev_hz(uint32_t hz)
 {
-    float tmpFdev = hz / FREQ_STEP_HZ;
-    uint16_t v;
-    //printf("tmpFdev:%f = %d / %f\r\n", tmpFdev, hz, FREQ_STEP_HZ);
-    v = (uint16_t)tmpFdev;
-    m_xcvr.write_u16(REG_FSK_FDEVMSB, v);
+    SX127X_PROBE(fsk_set_tx_fdev_hz, m_xcvr.m_hal);
+    m_xcvr.write_u16(REG_FSK_FDEVMSB, sx127x_hz_to_frf(hz));
 }
     
 uint32_t SX127x_fsk::get_tx_fdev_hz(void)
 {
     uint16_t fdev = m_xcvr.read_u16(REG_FSK_FDEVMSB);
-    return fdev * FREQ_STEP_HZ;
+    return sx127x_frf_to_hz(fdev);
 }
 
-uint32_t SX127x_fsk::ComputeRxBw( uint8_t mantisse, uint8_t exponent )
-{
-    // rxBw
-    if (m_xcvr.RegOpMode.bits.ModulationType == 0)
-        return XTAL_FREQ / (mantisse * (1 << (exponent+2)));
-    else
-        return XTAL_FREQ / (mantisse * (1 << (exponent+3)));    
-}
+#define FSK_RX_BW_COUNT 24
 
+/* FSK bandwidths, index exponent * 3 + mantissa field, OOK is half */
+#define FSK_RX_BW3(e)   fsk_rx_bw_hz(e*3, false), fsk_rx_bw_hz(e*3+1, false), fsk_rx_bw_hz(e*3+2, false)
+static const uint32_t fsk_rx_bw[FSK_RX_BW_COUNT] = {
+    FSK_RX_BW3(0), FSK_RX_BW3(1), FSK_RX_BW3(2), FSK_RX_BW3(3),
+    FSK_RX_BW3(4), FSK_RX_BW3(5), FSK_RX_BW3(6), FSK_RX_BW3(7)
+};
+#undef FSK_RX_BW3
 
-void SX127x_fsk::ComputeRxBwMantExp( uint32_t rxBwValue, uint8_t* mantisse, uint8_t* exponent )
+/* nearest of the 24 bandwidths into reg's mantissa and exponent, tie goes to the wider */
+void SX127x_fsk::set_bw_bits(RegRxBw_t& reg, uint32_t bw_hz)
 {
-    uint8_t tmpExp, tmpMant;
-    double tmpRxBw;
-    double rxBwMin = 10e6;
+    uint8_t ook = m_xcvr.RegOpMode.bits.ModulationType != 0;
+    uint8_t i = 0;
 
-    for( tmpExp = 0; tmpExp < 8; tmpExp++ ) {
-        for( tmpMant = 16; tmpMant <= 24; tmpMant += 4 ) {
-            tmpRxBw = ComputeRxBw(tmpMant, tmpExp);
-            if( fabs( tmpRxBw - rxBwValue ) < rxBwMin ) {
-                rxBwMin = fabs( tmpRxBw - rxBwValue );
-                *mantisse = tmpMant;
-                *exponent = tmpExp;
-            }
-        }
-    }
-}
+    while (i < FSK_RX_BW_COUNT-1 && (fsk_rx_bw[i] >> ook) > bw_hz)
+        i++;
+    if (i > 0 && (fsk_rx_bw[i] >> ook) <= bw_hz &&
+        (fsk_rx_bw[i-1] >> ook) - bw_hz <= bw_hz - (fsk_rx_bw[i] >> ook))
+        i--;    // wider neighbour is at least as close
 
+    reg.bits.Mantissa = i % 3;
+    reg.bits.Exponent = i / 3;
+}
 
 uint32_t SX127x_fsk::get_rx_bw_hz(uint8_t addr)
 {
     RegRxBw_t reg_bw;
-    uint8_t mantissa;
     
     if (m_xcvr.RegOpMode.bits.LongRangeMode)
         return 0;
 
     reg_bw.octet = m_xcvr.read_reg(addr);
-    switch (reg_bw.bits.Mantissa) {
-        case 0: mantissa = 16; break;
-        case 1: mantissa = 20; break;
-        case 2: mantissa = 24; break;
-        default: mantissa = 0; break;
-    }
 
     if (addr == REG_FSK_RXBW)
         RegRxBw.octet = reg_bw.octet;
     else if (addr == REG_FSK_AFCBW)
         RegAfcBw.octet = reg_bw.octet;
 
-    return ComputeRxBw(mantissa, reg_bw.bits.Exponent);    
+    if (reg_bw.bits.Mantissa > 2)
+        return 0;   // reserved
+    return fsk_rx_bw[reg_bw.bits.Exponent * 3 + reg_bw.bits.Mantissa] >> (m_xcvr.RegOpMode.bits.ModulationType != 0);
 }
 
 
 void SX127x_fsk::set_rx_dcc_bw_hz(uint32_t bw_hz, char afc)
 {
-    uint8_t mantisse = 0;
-    uint8_t exponent = 0;
+    SX127X_PROBE(fsk_set_rx_dcc_bw_hz, m_xcvr.m_hal);
     
     if (m_xcvr.RegOpMode.bits.LongRangeMode)
         return;    
 
-    ComputeRxBwMantExp( bw_hz, &mantisse, &exponent );
-    //printf("bw_hz:%d, mantisse:%d, exponent:%d\n", bw_hz, mantisse, exponent );
-    switch( mantisse ) {
-        case 16:
-            RegRxBw.bits.Mantissa = 0;
-            break;
-        case 20:
-            RegRxBw.bits.Mantissa = 1;
-            break;
-        case 24:
-            RegRxBw.bits.Mantissa = 2;
-            break;
-        default:
-            // Something went terribely wrong
-            printf("maintisse:%d\n", mantisse);
-            break;
+    if (afc) {
+        set_bw_bits(RegAfcBw, bw_hz);
+        m_xcvr.write_reg(REG_FSK_AFCBW, RegAfcBw.octet);
+    } else {
+        set_bw_bits(RegRxBw, bw_hz);
+        m_xcvr.write_reg(REG_FSK_RXBW, RegRxBw.octet);
     }
-    RegRxBw.bits.Exponent = exponent;
+}
 
-    if (afc)
-        m_xcvr.write_reg(REG_FSK_AFCBW, RegRxBw.octet);
-    else
-        m_xcvr.write_reg(REG_FSK_RXBW, RegRxBw.octet);
+void SX127x_fsk::set_rx_afc_bw_hz(uint32_t rx_hz, uint32_t afc_hz)
+{
+    SX127X_PROBE(fsk_set_rx_afc_bw_hz, m_xcvr.m_hal);
+
+    if (m_xcvr.RegOpMode.bits.LongRangeMode)
+        return;
+
+    set_bw_bits(RegRxBw, rx_hz);
+    set_bw_bits(RegAfcBw, afc_hz);
+    m_xcvr.write_u16(REG_FSK_RXBW, (RegRxBw.octet << 8) | RegAfcBw.octet);   // 0x12, 0x13 adjacent
 }
 
 
-void SX127x_fsk::start_tx(uint16_t arg_len)
+void SX127x_fsk::start_tx(const uint8_t* buf, uint16_t arg_len)
 {
+    SX127X_PROBE(fsk_start_tx, m_xcvr.m_hal);
     uint16_t pkt_buf_len;
     RegIrqFlags2_t RegIrqFlags2;
     int maxlen = FSK_FIFO_SIZE-1;
@@ -246,33 +288,38 @@ void SX127x_fsk::start_tx(uint16_t arg_len)
         pkt_buf_len = RegPktConfig2.bits.PayloadLength;
     }
 
+    if (seq_state != FSK_SEQ_OFF)
+        seq_stop();
+    tx_left = 0;
+    tx_ending = false;
+    m_xcvr.watch_dio1_fall(false);
+
     RegIrqFlags2.octet = m_xcvr.read_reg(REG_FSK_IRQFLAGS2);
     if (RegIrqFlags2.bits.FifoEmpty) {
         if (RegPktConfig1.bits.PacketFormatVariable) {
             --maxlen;   // space for length byte
-            if (pkt_buf_len > maxlen) {
-                /*setup_FifoLevel(FALLING_EDGE);
-                radio_write_fifo_(pkt_buf, maxlen, pkt_buf_len);
-                remaining_ = pkt_buf_len - maxlen;
-                printf("var-oversized %d R=%d\r\n", pkt_buf_len, remaining_);*/
+            if (pkt_buf_len > 255) {
                 printf("var-oversized %d\r\n", pkt_buf_len);
-            } else {
-                //setup_FifoLevel(NO_EDGE); // disable 
-                write_fifo(pkt_buf_len);
-                //remaining_ = 0; // all was sent
-            }
-        } else { // fixed-length pkt format...
-            pkt_buf_len = RegPktConfig2.bits.PayloadLength;
-            if (RegPktConfig2.bits.PayloadLength > maxlen) {
-                /*setup_FifoLevel(FALLING_EDGE);
-                radio_write_fifo_(pkt_buf, maxlen, -1);
-                remaining_ = SX1272FSK->RegPktConfig2.bits.PayloadLength - maxlen;*/
-                printf("todo: fsk large packet\r\n");
-            } else {
-                //setup_FifoLevel(NO_EDGE); // disable
-                write_fifo(RegPktConfig2.bits.PayloadLength);
+                return;
             }
         }
+        if (pkt_buf_len > maxlen) {
+            /* larger than FIFO: first part now, rest from service() on FifoLevel falling */
+            load_fifo(buf, maxlen, RegPktConfig1.bits.PacketFormatVariable ? pkt_buf_len : -1);
+            tx_stream_buf = buf + maxlen;
+            tx_left = pkt_buf_len - maxlen;
+
+            if (RegFifoThreshold.bits.FifoThreshold != FSK_TX_REFILL_LEVEL) {
+                RegFifoThreshold.bits.FifoThreshold = FSK_TX_REFILL_LEVEL;
+                m_xcvr.write_reg(REG_FSK_FIFOTHRESH, RegFifoThreshold.octet);
+            }
+            if (m_xcvr.RegDioMapping1.bits.Dio1Mapping != 0) {
+                m_xcvr.RegDioMapping1.bits.Dio1Mapping = 0;    // DIO1 to FifoLevel
+                m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
+            }
+            m_xcvr.watch_dio1_fall(true);
+        } else
+            load_fifo(buf, pkt_buf_len, RegPktConfig1.bits.PacketFormatVariable ? pkt_buf_len : -1);
     } else
         printf("fifo not empty %02x\r\n", RegIrqFlags2.octet);
 
@@ -283,7 +330,7 @@ void SX127x_fsk::start_tx(uint16_t arg_len)
 void SX127x_fsk::config_dio0_for_pktmode_rx()
 {
     if (RegPktConfig2.bits.DataModePacket) {
-        if (RegPktConfig1.bits.CrcOn) {
+        if (RegPktConfig1.bits.CrcOn && !rx_stream_buf) {
             if (m_xcvr.RegDioMapping1.bits.Dio0Mapping != 1) {
                 m_xcvr.RegDioMapping1.bits.Dio0Mapping = 1; // to CrcOk
                 m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
@@ -297,15 +344,63 @@ void SX127x_fsk::config_dio0_for_pktmode_rx()
     }
 }
 
+/* leave streaming RX: PacketConfig1 back as the application had it */
+void SX127x_fsk::rx_stream_end()
+{
+    if (!rx_stream_buf)
+        return;
+    rx_stream_buf = NULL;
+    if (RegPktConfig1.bits.CrcAutoClearOff != rx_crc_auto_clear_off) {
+        RegPktConfig1.bits.CrcAutoClearOff = rx_crc_auto_clear_off;
+        m_xcvr.write_reg(REG_FSK_PACKETCONFIG1, RegPktConfig1.octet);
+    }
+}
+
 void SX127x_fsk::start_rx()
 {
+    rx_stream_end();
+    receive();
+}
+
+void SX127x_fsk::start_rx(uint8_t* buf, uint16_t size)
+{
+    if (!rx_stream_buf)
+        rx_crc_auto_clear_off = RegPktConfig1.bits.CrcAutoClearOff;
+    rx_stream_buf = buf;
+    rx_stream_size = size;
+    rx_got = 0;
+    rx_len_known = !RegPktConfig1.bits.PacketFormatVariable;
+    if (rx_len_known)
+        rx_buf_length = RegPktConfig2.bits.PayloadLength;
+
+    if (!RegPktConfig1.bits.CrcAutoClearOff) {
+        RegPktConfig1.bits.CrcAutoClearOff = 1;    // PayloadReady even on CRC error
+        m_xcvr.write_reg(REG_FSK_PACKETCONFIG1, RegPktConfig1.octet);
+    }
+    if (RegFifoThreshold.bits.FifoThreshold != FSK_RX_DRAIN_LEVEL) {
+        RegFifoThreshold.bits.FifoThreshold = FSK_RX_DRAIN_LEVEL;
+        m_xcvr.write_reg(REG_FSK_FIFOTHRESH, RegFifoThreshold.octet);
+    }
+    if (m_xcvr.RegDioMapping1.bits.Dio1Mapping != 0) {
+        m_xcvr.RegDioMapping1.bits.Dio1Mapping = 0;    // DIO1 to FifoLevel
+        m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
+    }
+    receive();
+}
+
+void SX127x_fsk::receive()
+{
+    SX127X_PROBE(fsk_start_rx, m_xcvr.m_hal);
     if (m_xcvr.RegOpMode.bits.LongRangeMode)
         return;
+    tx_ending = false;
+    if (seq_state != FSK_SEQ_OFF)
+        seq_stop();
         
     if (m_xcvr.RegOpMode.bits.Mode == RF_OPMODE_RECEIVER) {
         // was already receiving, restart it
         m_xcvr.set_opmode(RF_OPMODE_STANDBY);
-        wait(0.01);
+        m_xcvr.m_hal.wait_us(10000);
     }
     
     config_dio0_for_pktmode_rx();
@@ -340,36 +435,305 @@ void SX127x_fsk::set_modulation_shaping(uint8_t s)
     } 
 }
 
-service_action_e SX127x_fsk::service()
+/* FifoLevel dropped: at most FSK_TX_REFILL_LEVEL bytes remain, the rest of the FIFO is free */
+void SX127x_fsk::tx_refill()
+{
+    uint16_t n = FSK_FIFO_SIZE - FSK_TX_REFILL_LEVEL;
+
+    if (n > tx_left)
+        n = tx_left;
+    load_fifo(tx_stream_buf, n, -1);
+    tx_stream_buf += n;
+    tx_left -= n;
+    if (tx_left == 0)
+        m_xcvr.watch_dio1_fall(false);
+}
+
+/* n bytes from FIFO to caller's buffer, past its size discarded.
+ * FIFO never holds more than FSK_FIFO_SIZE: the rest was lost to overrun or a late service() */
+void SX127x_fsk::rx_take(uint16_t n)
+{
+    uint8_t junk[FSK_FIFO_SIZE];
+    uint16_t keep;
+
+    if (n > FSK_FIFO_SIZE)
+        n = FSK_FIFO_SIZE;
+    keep = rx_got < rx_stream_size ? rx_stream_size - rx_got : 0;
+    if (keep > n)
+        keep = n;
+    if (keep > 0)
+        read_fifo(rx_stream_buf + rx_got, keep);
+    if (n > keep)
+        read_fifo(junk, n - keep);
+    rx_got += n;
+}
+
+/* FifoLevel: more than FSK_RX_DRAIN_LEVEL bytes waiting, take them while level stays up.
+ * Flag is checked first, an edge queued during the previous drain may be stale. */
+void SX127x_fsk::rx_drain()
+{
+    RegIrqFlags2_t flags;
+    uint16_t n;
+
+    for (;;) {
+        flags.octet = m_xcvr.read_reg(REG_FSK_IRQFLAGS2);
+        if (!flags.bits.FifoLevel || flags.bits.PayloadReady)
+            return;     // PayloadReady: rx_stream_done() takes the rest, CrcOk still valid
+        n = FSK_RX_DRAIN_LEVEL + 1;
+        if (!rx_len_known) {
+            rx_buf_length = m_xcvr.read_reg(REG_FIFO);
+            rx_len_known = true;
+            n--;
+        }
+        if (n > rx_buf_length - rx_got)
+            n = rx_buf_length - rx_got;     // next packet's bytes stay in FIFO
+        if (n == 0)
+            return;
+        rx_take(n);
+    }
+}
+
+/* PayloadReady: rest of packet is in FIFO */
+service_action_e SX127x_fsk::rx_stream_done()
+{
+    RegIrqFlags2_t flags;
+
+    /* CrcOk clears with FifoEmpty: sample before reading out */
+    flags.octet = m_xcvr.read_reg(REG_FSK_IRQFLAGS2);
+    rx_crc_ok = !RegPktConfig1.bits.CrcOn || flags.bits.CrcOk;
+
+    if (!rx_len_known)
+        rx_buf_length = m_xcvr.read_reg(REG_FIFO);
+    if (rx_buf_length > rx_got)
+        rx_take(rx_buf_length - rx_got);
+
+    /* next packet: fixed length keeps rx_buf_length */
+    rx_got = 0;
+    rx_len_known = !RegPktConfig1.bits.PacketFormatVariable;
+    return SERVICE_READ_FIFO;
+}
+
+/* PayloadReady: whole packet is in FIFO */
+void SX127x_fsk::read_packet()
 {
-    int i;
+    if (RegRxConfig.bits.AfcAutoOn)
+        RegAfcValue = m_xcvr.read_s16(REG_FSK_AFCMSB);
+        
+    if (RegPktConfig1.bits.PacketFormatVariable) {
+        rx_buf_length = m_xcvr.read_reg(REG_FIFO);
+    } else {
+        rx_buf_length = RegPktConfig2.bits.PayloadLength;
+    }
     
+    if (m_xcvr.rx_dest) {
+        uint8_t* dest = m_xcvr.rx_dest;
+        uint16_t left = rx_buf_length;
+        while (left > 0) {
+            /* fixed length goes to 2047: read_fifo() takes at most 255 per burst */
+            uint8_t n = left > 255 ? 255 : left;
+            read_fifo(dest, n);
+            dest += n;
+            left -= n;
+        }
+    }
+}
+
+uint32_t SX127x_fsk::set_timer_us(uint8_t timer, uint32_t us)
+{
+    uint8_t res = 0;
+    uint32_t coef = 0;
+
+    if (us > 0) {
+        for (res = 1; res < 3; res++) {
+            if (us <= 255 * (uint32_t)FSK_TIMER_RES_US(res))
+                break;
+        }
+        coef = (us + FSK_TIMER_RES_US(res) - 1) / FSK_TIMER_RES_US(res);
+        if (coef > 255)
+            coef = 255;
+    }
+
+    if (timer == 1)
+        RegTimerResol.bits.timer1_resol = res;
+    else
+        RegTimerResol.bits.timer2_resol = res;
+    m_xcvr.write_reg(REG_FSK_TIMERRESOL, RegTimerResol.octet);
+    m_xcvr.write_reg(timer == 1 ? REG_FSK_TIMER1COEF : REG_FSK_TIMER2COEF, coef);
+
+    return coef * FSK_TIMER_RES_US(res);
+}
+
+/* RegSeqConfig2 must be in place before RegSeqConfig1 starts the sequencer */
+void SX127x_fsk::seq_start(uint8_t from_start)
+{
+    SX127X_PROBE(fsk_seq_start, m_xcvr.m_hal);
+
+    m_xcvr.write_reg(REG_FSK_SEQCONFIG2, RegSeqConfig2.octet);
+
+    RegSeqConfig1.bits.FromStart = from_start;
+    RegSeqConfig1.bits.SequencerStop = 0;
+    RegSeqConfig1.bits.SequencerStart = 1;
+    m_xcvr.write_reg(REG_FSK_SEQCONFIG1, RegSeqConfig1.octet);
+    RegSeqConfig1.bits.SequencerStart = 0;  // trigger bit, reads back 0
+}
+
+bool SX127x_fsk::seq_tx_rx(const uint8_t* buf, uint8_t len, uint32_t rx_timeout_us)
+{
+    uint32_t bytes;
+
+    if (m_xcvr.RegOpMode.bits.LongRangeMode)
+        return false;
+    if (len >= FSK_FIFO_SIZE)
+        return false;   // with length byte, must fit FIFO in one load
+
+    if (seq_state != FSK_SEQ_OFF || m_xcvr.RegOpMode.bits.Mode != RF_OPMODE_STANDBY)
+        seq_stop();     // standby is the initial mode the sequencer returns to
+    tx_left = 0;
+    tx_ending = false;
+    rx_stream_end();
+    m_xcvr.watch_dio1_fall(false);
+
+    if (m_xcvr.RegDioMapping1.bits.Dio0Mapping != 0) {
+        m_xcvr.RegDioMapping1.bits.Dio0Mapping = 0;    // PacketSent in TX, PayloadReady in RX
+        m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
+    }
+
+    RegTimerResol.octet = 0;    // both timers programmed here, shadow may never have been read
+    rx_timeout_us = set_timer_us(2, rx_timeout_us);
+    set_timer_us(1, 0);
+    write_fifo(buf, len);
+
+    /* Timer2 can't expire before request is on air and window elapsed */
+    bytes = m_xcvr.read_u16(REG_FSK_PREAMBLEMSB) + len;
+    if (RegSyncConfig.bits.SyncOn)
+        bytes += RegSyncConfig.bits.SyncSize + 1;
+    if (RegPktConfig1.bits.PacketFormatVariable)
+        bytes++;
+    if (RegPktConfig1.bits.CrcOn)
+        bytes += 2;
+    seq_end_us = m_xcvr.m_hal.now_us() + bytes * 8 * bit_period_us + rx_timeout_us;
+
+    RegSeqConfig2.bits.FromReceive = FSK_SEQ_FROMRX_PKT_PAYLOADREADY;
+    RegSeqConfig2.bits.FromRxTimeout = FSK_SEQ_FROMRXTIMEOUT_LOWPOWER;
+    RegSeqConfig2.bits.FromPacketReceived = FSK_SEQ_FROMPKT_LOWPOWER;
+    RegSeqConfig1.bits.FromTransmit = 1;        // receive after PacketSent
+    RegSeqConfig1.bits.FromIdle = 0;
+    RegSeqConfig1.bits.LowPowerSelection = 0;   // LowPower: sequencer off, back to initial mode
+    RegSeqConfig1.bits.IdleMode = 0;
+    seq_state = FSK_SEQ_TX_RX;
+    seq_start(FSK_SEQ_FROMSTART_TX);
+    return true;
+}
+
+void SX127x_fsk::seq_listen(uint32_t sleep_us, uint32_t rx_us)
+{
+    if (m_xcvr.RegOpMode.bits.LongRangeMode)
+        return;
+
+    if (seq_state != FSK_SEQ_OFF || m_xcvr.RegOpMode.bits.Mode != RF_OPMODE_STANDBY)
+        seq_stop();
+    tx_left = 0;
+    tx_ending = false;
+    rx_stream_end();
+    m_xcvr.watch_dio1_fall(false);
+
+    if (m_xcvr.RegDioMapping1.bits.Dio0Mapping != 0) {
+        m_xcvr.RegDioMapping1.bits.Dio0Mapping = 0;    // PayloadReady
+        m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
+    }
+
+    RegTimerResol.octet = 0;
+    set_timer_us(1, sleep_us);
+    set_timer_us(2, rx_us);
+
+    RegSeqConfig2.bits.FromReceive = FSK_SEQ_FROMRX_PKT_PAYLOADREADY;
+    RegSeqConfig2.bits.FromRxTimeout = FSK_SEQ_FROMRXTIMEOUT_LOWPOWER;
+    RegSeqConfig2.bits.FromPacketReceived = FSK_SEQ_FROMPKT_OFF;   // stay with packet, FIFO kept
+    RegSeqConfig1.bits.FromTransmit = 0;
+    RegSeqConfig1.bits.FromIdle = 1;            // receive on Timer1
+    RegSeqConfig1.bits.LowPowerSelection = 1;   // LowPower: idle
+    RegSeqConfig1.bits.IdleMode = 1;            // idle in sleep
+    seq_state = FSK_SEQ_LISTEN;
+    seq_start(FSK_SEQ_FROMSTART_LOWPOWER);
+}
+
+void SX127x_fsk::seq_stop()
+{
+    if (seq_state != FSK_SEQ_OFF) {
+        RegSeqConfig1.bits.SequencerStop = 1;
+        m_xcvr.write_reg(REG_FSK_SEQCONFIG1, RegSeqConfig1.octet);
+        RegSeqConfig1.bits.SequencerStop = 0;
+        seq_state = FSK_SEQ_OFF;
+    }
+    m_xcvr.set_opmode(RF_OPMODE_STANDBY);
+}
+
+/* sequencer running: DIO0 rises on PacketSent and PayloadReady alike, flags tell which */
+service_action_e SX127x_fsk::seq_service()
+{
+    RegIrqFlags2_t flags;
+
+    if (m_xcvr.dio_pending(0)) {
+        flags.octet = m_xcvr.read_reg(REG_FSK_IRQFLAGS2);
+        if (flags.bits.PayloadReady) {
+            read_packet();
+            seq_stop();
+            return SERVICE_READ_FIFO;
+        }
+    }
+
+    if (seq_state != FSK_SEQ_TX_RX || (int32_t)(m_xcvr.m_hal.now_us() - seq_end_us) < 0)
+        return SERVICE_NONE;
+
+    /* Timer2 may have expired: sequencer is back in standby unless still transmitting or receiving */
+    if ((m_xcvr.read_reg(REG_OPMODE) & 7) != RF_OPMODE_STANDBY) {
+        seq_end_us = m_xcvr.m_hal.now_us() + 8 * bit_period_us;   // look again one byte later
+        return SERVICE_NONE;
+    }
+    flags.octet = m_xcvr.read_reg(REG_FSK_IRQFLAGS2);
+    if (flags.bits.PayloadReady) {
+        read_packet();      // completed since dio_pending()
+        seq_stop();
+        return SERVICE_READ_FIFO;
+    }
+    seq_state = FSK_SEQ_OFF;
+    m_xcvr.RegOpMode.bits.Mode = RF_OPMODE_STANDBY;
+    return SERVICE_RX_TIMEOUT;
+}
+
+service_action_e SX127x_fsk::service()
+{
+    SX127X_PROBE(fsk_service, m_xcvr.m_hal);
+    if (seq_state != FSK_SEQ_OFF)
+        return seq_service();
     if (m_xcvr.RegOpMode.bits.Mode == RF_OPMODE_TRANSMITTER) {
-        if (m_xcvr.dio0) {
-            /* packetSent comes at start of last bit, wait for one bit period */
-            wait_us(bit_period_us);
+        if (tx_left > 0 && m_xcvr.dio1_fall_pending())
+            tx_refill();
+        if (!tx_ending && m_xcvr.dio_pending(0)) {
+            /* packetSent comes at start of last bit, finish one bit period later */
+            tx_end_us = m_xcvr.dio_time_us[0] + bit_period_us;
+            tx_ending = true;
+        }
+        if (tx_ending) {
+            if ((int32_t)(m_xcvr.m_hal.now_us() - tx_end_us) < 0)
+                return SERVICE_NONE;
+            tx_ending = false;
             if (tx_done_sleep)
                 m_xcvr.set_opmode(RF_OPMODE_SLEEP);
             else
                 m_xcvr.set_opmode(RF_OPMODE_STANDBY);
             return SERVICE_TX_DONE;
         }
-    } else if (RegPktConfig2.bits.DataModePacket && m_xcvr.dio0) {
-        if (RegRxConfig.bits.AfcAutoOn)
-            RegAfcValue = m_xcvr.read_s16(REG_FSK_AFCMSB);
-            
-        if (RegPktConfig1.bits.PacketFormatVariable) {
-            rx_buf_length = m_xcvr.read_reg(REG_FIFO);
-        } else {
-            rx_buf_length = RegPktConfig2.bits.PayloadLength;
-        }
-        
-        m_xcvr.m_cs = 0;
-        m_xcvr.m_spi.write(REG_FIFO); // bit7 is low for reading from radio
-        for (i = 0; i < rx_buf_length; i++) {
-            m_xcvr.rx_buf[i] = m_xcvr.m_spi.write(0);
+    } else if (RegPktConfig2.bits.DataModePacket && rx_stream_buf) {
+        if (m_xcvr.dio_pending(1))
+            rx_drain();
+        if (m_xcvr.dio_pending(0)) {
+            if (RegRxConfig.bits.AfcAutoOn)
+                RegAfcValue = m_xcvr.read_s16(REG_FSK_AFCMSB);
+            return rx_stream_done();
         }
-        m_xcvr.m_cs = 1;
+    } else if (RegPktConfig2.bits.DataModePacket && m_xcvr.dio_pending(0)) {
+        read_packet();
         return SERVICE_READ_FIFO;
     }
     
@@ -66,6 +66,25 @@
 
 #define FSK_FIFO_SIZE       64
 #define FSK_FIFO_SIZE_HALF  (FSK_FIFO_SIZE>>1)
+#define FSK_TX_REFILL_LEVEL 16  // FifoThreshold while streaming TX: refill once this few bytes remain
+#define FSK_RX_DRAIN_LEVEL  31  // FifoThreshold while streaming RX: drain once more bytes than this arrived
+
+/* top level sequencer transitions, RegSeqConfig1/2 field values */
+#define FSK_SEQ_FROMSTART_LOWPOWER      0
+#define FSK_SEQ_FROMSTART_TX            2
+#define FSK_SEQ_FROMRX_PKT_PAYLOADREADY 1   // to PacketReceived on PayloadReady
+#define FSK_SEQ_FROMRXTIMEOUT_LOWPOWER  2
+#define FSK_SEQ_FROMPKT_OFF             0
+#define FSK_SEQ_FROMPKT_LOWPOWER        2
+
+/* Timer1/Timer2 resolution field: 1=64us, 2=4.1ms, 3=262ms, period is resolution * coefficient */
+#define FSK_TIMER_RES_US(r)     ((r) == 1 ? 64 : (r) == 2 ? 4100 : (r) == 3 ? 262000 : 0)
+
+typedef enum {
+    FSK_SEQ_OFF = 0,
+    FSK_SEQ_TX_RX,      // transmit, receive until packet or Timer2, back to standby
+    FSK_SEQ_LISTEN      // sleep Timer1, receive Timer2, repeat until packet
+} fsk_seq_e;
 
 typedef union {
     struct {    // sx1272 register 0x0d
@@ -279,22 +298,87 @@ class SX127x_fsk {
         /** put FSK modem to some functioning default */
         void init(void);
         
+#ifndef SX127X_NO_PKT_BUFS
         /** fills radio FIFO with payload contents, prior to transmission
          * @param len count of bytes to put into FIFO
          * @note tx_buf[] should contain desired payload (to send) prior to calling
          */
         void write_fifo(uint8_t len);        
+
+        /** fills radio FIFO in background, see write_fifo()
+         * @param len count of bytes to put into FIFO
+         * @param done called when payload is in FIFO, possibly from interrupt context
+         */
+        void write_fifo_async(uint8_t len, Callback<void()> done);
         
         void start_tx(uint16_t len);
+#endif
+
+        /** fills radio FIFO from caller's buffer, no copy through tx_buf[]
+         * @param buf payload
+         * @param len count of bytes to put into FIFO
+         */
+        void write_fifo(const uint8_t* buf, uint8_t len);
+
+        /** fills radio FIFO from caller's buffer in background
+         * @param buf payload, must stay valid until done
+         * @param len count of bytes to put into FIFO
+         * @param done called when payload is in FIFO, possibly from interrupt context
+         */
+        void write_fifo_async(const uint8_t* buf, uint8_t len, Callback<void()> done);
+
+        /** transmit a packet from caller's buffer.
+         * Packets larger than the FIFO are streamed: the FIFO is refilled from buf by service()
+         * each time FifoLevel (DIO1) drops to FSK_TX_REFILL_LEVEL bytes, until all is sent.
+         * @param buf payload, must stay valid until SERVICE_TX_DONE when larger than the FIFO
+         * @param len size of packet, up to 255 in variable length format; ignored in fixed length
+         *        format, where RegPktConfig2.bits.PayloadLength (up to 2047) is sent
+         * @note while streaming, service() must be called before the FIFO drains: within
+         *       FSK_TX_REFILL_LEVEL byte periods of the DIO1 falling edge
+         * @note SERVICE_TX_DONE comes one bit period after PacketSent, with no DIO edge of its own:
+         *       an application sleeping on DIO interrupts must also wake at tx_end_us while tx_ending
+         */
+        void start_tx(const uint8_t* buf, uint16_t len);
+
+        /** pull received packet from radio FIFO into caller's buffer
+         * @param buf destination, at least rx_buf_length bytes
+         * @param len count of bytes to read (rx_buf_length)
+         * @note with SX127x::rx_dest NULL, call this on SERVICE_READ_FIFO
+         */
+        void read_fifo(uint8_t* buf, uint8_t len);
         
         void start_rx(void);
-        uint8_t rx_buf_length;
+
+        /** receive into caller's buffer, packets larger than the FIFO included.  While a packet
+         * arrives, service() drains the FIFO each time FifoLevel (DIO1) shows more than
+         * FSK_RX_DRAIN_LEVEL bytes.  At PayloadReady the rest is read and service() returns
+         * SERVICE_READ_FIFO, packet length in rx_buf_length and CRC result in rx_crc_ok.
+         * CrcAutoClearOff is set so that failed packets are reported too; start_rx() puts back
+         * the value it had before.
+         * @param buf destination, must stay valid while receiving
+         * @param size of buf: bytes of longer packets are discarded, rx_buf_length still gives the packet length
+         * @note service() must be called within (FSK_FIFO_SIZE - FSK_RX_DRAIN_LEVEL) byte periods of each DIO1 edge
+         */
+        void start_rx(uint8_t* buf, uint16_t size);
+
+        //! length of last packet received
+        uint16_t rx_buf_length;
+
+        //! start_rx(buf, size): CRC result of last packet, true if CRC off
+        bool rx_crc_ok;
+
         void config_dio0_for_pktmode_rx(void);
         
         uint32_t get_rx_bw_hz(uint8_t addr);
         
-        /** bw_hz: single side (ssb) */
+        /** bw_hz: single side (ssb), nearest achievable is used */
         void set_rx_dcc_bw_hz(uint32_t bw_hz, char afc);
+
+        /** RxBw and AfcBw in one SPI burst, nearest achievable bandwidths (single side)
+         * @param rx_hz channel filter bandwidth
+         * @param afc_hz channel filter bandwidth during AFC
+         */
+        void set_rx_afc_bw_hz(uint32_t rx_hz, uint32_t afc_hz);
         
         uint32_t get_bitrate(void);
         void set_bitrate(uint32_t);
@@ -326,12 +410,67 @@ class SX127x_fsk {
         RegImageCal_t        RegImageCal;         // 0x3b
         
         bool tx_done_sleep; // false:go to standby after tx done, true:sleep
+
+        //! PacketSent seen, last bit still on air: call service() at or after tx_end_us
+        bool tx_ending;
+        uint32_t tx_end_us;
+
+        /** program Timer1 or Timer2 of the sequencer, coarsest resolution only when needed
+         * @param timer 1 or 2
+         * @param us period, rounded up; 0 disables the timer
+         * @returns period programmed, saturated at 255 * 262ms
+         */
+        uint32_t set_timer_us(uint8_t timer, uint32_t us);
+
+        /** request/response without the MCU: sequencer transmits, turns around to receive,
+         * and returns to standby on a packet or after rx_timeout_us (Timer2).
+         * service() returns SERVICE_READ_FIFO with the response as from start_rx(), or SERVICE_RX_TIMEOUT.
+         * @param buf request, sent in one FIFO load
+         * @param len request length, less than FSK_FIFO_SIZE
+         * @param rx_timeout_us receive window, starting when the request has been sent
+         * @returns false if len doesn't fit the FIFO or radio is in LoRa mode: nothing sent
+         * @note Timer2 expiry has no DIO edge: an application sleeping on DIO interrupts must also
+         *       wake at seq_end_us, see seq_state
+         */
+        bool seq_tx_rx(const uint8_t* buf, uint8_t len, uint32_t rx_timeout_us);
+
+        /** listen mode: sequencer sleeps sleep_us (Timer1), receives rx_us (Timer2), and repeats
+         * until a packet arrives.  service() returns SERVICE_READ_FIFO with the packet, radio in standby.
+         * @note FIFO is lost in sleep: packet must complete within the receive window once started
+         */
+        void seq_listen(uint32_t sleep_us, uint32_t rx_us);
+
+        /** stop sequencer, radio to standby */
+        void seq_stop(void);
+
+        //! sequence in progress, FSK_SEQ_OFF once service() has reported its end
+        fsk_seq_e seq_state;
+
+        //! FSK_SEQ_TX_RX: call service() at or after seq_end_us to detect the receive timeout
+        uint32_t seq_end_us;
         
         SX127x& m_xcvr;
         
     private:
-        unsigned int bit_period_us;
-        uint32_t ComputeRxBw( uint8_t mantisse, uint8_t exponent );
-        void ComputeRxBwMantExp( uint32_t rxBwValue, uint8_t* mantisse, uint8_t* exponent );     
+        void load_fifo(const uint8_t* buf, uint8_t len, int len_byte);
+        void tx_refill(void);
+        void receive(void);
+        void rx_take(uint16_t n);
+        void rx_drain(void);
+        service_action_e rx_stream_done(void);
+        void read_packet(void);
+        void seq_start(uint8_t from_start);
+        service_action_e seq_service(void);
+
+        const uint8_t* tx_stream_buf;   // rest of payload not yet in FIFO
+        uint16_t tx_left;               // 0: not streaming
+        uint8_t* rx_stream_buf;         // NULL: not streaming
+        bool rx_crc_auto_clear_off;     // application's CrcAutoClearOff, put back when streaming ends
+        void rx_stream_end(void);
+        uint16_t rx_stream_size;
+        uint16_t rx_got;                // payload bytes of current packet taken from FIFO
+        bool rx_len_known;              // variable length: length byte taken
+        unsigned int bit_period_us;     // rounded up, from RegBitrate
+        void set_bw_bits(RegRxBw_t& reg, uint32_t bw_hz);
                    
 };
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "sx127x_hal.h"
+#include "sx127x_instr.h"
+
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127X_HOST
+
+SX127x_mbed_hal::SX127x_mbed_hal(PinName dio_0, PinName dio_1, PinName cs, SPI& spi_r, PinName rst, PinName dio_3) :
+                dio0(dio_0), dio1(dio_1), dio3(dio_3), m_cs(cs), m_spi(spi_r), reset_pin(rst), has_dio3(dio_3 != NC)
+{
+    reset_pin.input();
+    m_cs = 1;
+    m_spi.format(8, 0);
+    m_spi.frequency(3000000);
+}
+
+void SX127x_mbed_hal::select(bool sel)
+{
+    if (sel)
+        SX127X_COUNT_CS();
+    m_cs = sel ? 0 : 1;
+}
+
+uint8_t SX127x_mbed_hal::transfer(uint8_t out)
+{
+    SX127X_COUNT_BYTES(1);
+    return m_spi.write(out);
+}
+
+void SX127x_mbed_hal::transfer(const uint8_t* tx, uint8_t* rx, int len)
+{
+    SX127X_COUNT_BYTES(len);
+#ifdef MBED_MAJOR_VERSION
+    /* block API: no per-byte call overhead */
+    m_spi.write((const char*)tx, tx ? len : 0, (char*)rx, rx ? len : 0);
+#else
+    int i;
+
+    for (i = 0; i < len; i++) {
+        uint8_t b = m_spi.write(tx ? tx[i] : 0);
+        if (rx)
+            rx[i] = b;
+    }
+#endif
+}
+
+void SX127x_mbed_hal::transfer_async(const uint8_t* tx, uint8_t* rx, int len, Callback<void()> done)
+{
+#if DEVICE_SPI_ASYNCH
+    SX127X_COUNT_BYTES(len);
+    async_done = done;
+    m_spi.transfer<uint8_t>(tx, tx ? len : 0, rx, rx ? len : 0, event_callback_t(this, &SX127x_mbed_hal::spi_event), SPI_EVENT_COMPLETE);
+#else
+    transfer(tx, rx, len);
+    done.call();
+#endif
+}
+
+#if DEVICE_SPI_ASYNCH
+void SX127x_mbed_hal::spi_event(int events)
+{
+    if (async_done)
+        async_done.call();
+}
+#endif
+
+int SX127x_mbed_hal::dio(uint8_t n)
+{
+    switch (n) {
+        case 0: return dio0.read();
+        case 1: return dio1.read();
+        case 3: return has_dio3 ? dio3.read() : 0;
+        default: return 0;
+    }
+}
+
+bool SX127x_mbed_hal::attach_dio(uint8_t n, Callback<void()> isr)
+{
+    switch (n) {
+        case 0: dio0.rise(isr); return true;
+        case 1: dio1.rise(isr); return true;
+        case 3:
+            if (!has_dio3)
+                return false;
+            dio3.rise(isr);
+            return true;
+        default: return false;
+    }
+}
+
+bool SX127x_mbed_hal::attach_dio_fall(uint8_t n, Callback<void()> isr)
+{
+    switch (n) {
+        case 0: dio0.fall(isr); return true;
+        case 1: dio1.fall(isr); return true;
+        case 3:
+            if (!has_dio3)
+                return false;
+            dio3.fall(isr);
+            return true;
+        default: return false;
+    }
+}
+
+void SX127x_mbed_hal::hw_reset()
+{
+    int in = reset_pin.read();
+    reset_pin.output();
+    reset_pin.write(1);
+    wait(0.05);
+    if (in == 1) { /* pin is pulled up somewhere? */
+        reset_pin.write(0);
+        wait(0.005);
+    }
+    reset_pin.input();
+    wait(0.005);
+}
+
+void SX127x_mbed_hal::wait_us(uint32_t us)
+{
+    ::wait_us(us);
+}
+
+uint32_t SX127x_mbed_hal::now_us()
+{
+    return us_ticker_read();
+}
+
+#endif /* !SX127X_HOST */
@@ -0,0 +1,139 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_HAL_H
+#define SX127x_HAL_H
+
+#ifdef SX127X_HOST
+#include <stdint.h>
+#include <stddef.h>
+#include "sx127x_callback.h"
+#else
+#include "mbed.h"
+#endif
+
+/** bus, GPIO and clock access used by SX127x.
+ * SX127x_mbed_hal is the board backend, host builds (SX127X_HOST defined)
+ * use SX127x_host_hal from sx127x_host.h
+ */
+class SX127x_hal {
+    public:
+        virtual ~SX127x_hal() { }
+
+        /** drive radio chip select
+         * @param sel true=selected (NSS low), false=deselected
+         */
+        virtual void select(bool sel) = 0;
+
+        /** clock one byte over SPI while selected
+         * @param out byte sent to radio
+         * @returns byte received from radio
+         */
+        virtual uint8_t transfer(uint8_t out) = 0;
+
+        /** clock a block of bytes over SPI while selected
+         * @param tx bytes sent to radio, NULL sends zeros
+         * @param rx bytes received from radio, NULL discards
+         * @param len count of bytes
+         */
+        virtual void transfer(const uint8_t* tx, uint8_t* rx, int len)
+        {
+            int i;
+            for (i = 0; i < len; i++) {
+                uint8_t b = transfer(tx ? tx[i] : 0);
+                if (rx)
+                    rx[i] = b;
+            }
+        }
+
+        /** start block transfer while selected, return before it completes.
+         * Backends without DMA/asynchronous SPI transfer here and call done before returning.
+         * @param tx bytes sent to radio, NULL sends zeros
+         * @param rx bytes received from radio, NULL discards
+         * @param len count of bytes
+         * @param done called when transfer complete, possibly from interrupt context
+         */
+        virtual void transfer_async(const uint8_t* tx, uint8_t* rx, int len, Callback<void()> done)
+        {
+            transfer(tx, rx, len);
+            done.call();
+        }
+
+        /** read radio DIO pin level
+         * @param n DIO number
+         * @returns pin level, 0 for pins not connected
+         */
+        virtual int dio(uint8_t n) = 0;
+
+        /** call isr on rising edge of radio DIO pin
+         * @param n DIO number
+         * @param isr called from interrupt context
+         * @returns false if backend has no interrupt on this pin: caller must poll dio()
+         */
+        virtual bool attach_dio(uint8_t n, Callback<void()> isr) { (void)n; (void)isr; return false; }
+
+        /** call isr on falling edge of radio DIO pin
+         * @param n DIO number
+         * @param isr called from interrupt context, empty to detach
+         * @returns false if backend has no interrupt on this pin: caller must poll dio()
+         */
+        virtual bool attach_dio_fall(uint8_t n, Callback<void()> isr) { (void)n; (void)isr; return false; }
+
+        /** pulse radio reset pin */
+        virtual void hw_reset(void) = 0;
+
+        /** busy wait */
+        virtual void wait_us(uint32_t us) = 0;
+
+        /** free running microsecond clock, wraps at 2^32 */
+        virtual uint32_t now_us(void) = 0;
+};
+
+#ifndef SX127X_HOST
+/** mbed backend: SPI, chip select and DIO pins */
+class SX127x_mbed_hal : public SX127x_hal {
+    public:
+        /** @param dio_3 optional, NC if DIO3 is not wired */
+        SX127x_mbed_hal(PinName dio_0, PinName dio_1, PinName cs, SPI&, PinName rst, PinName dio_3 = NC);
+
+        void select(bool sel);
+        uint8_t transfer(uint8_t out);
+        void transfer(const uint8_t* tx, uint8_t* rx, int len);
+        void transfer_async(const uint8_t* tx, uint8_t* rx, int len, Callback<void()> done);
+        int dio(uint8_t n);
+        bool attach_dio(uint8_t n, Callback<void()> isr);
+        bool attach_dio_fall(uint8_t n, Callback<void()> isr);
+        void hw_reset(void);
+        void wait_us(uint32_t us);
+        uint32_t now_us(void);
+
+        InterruptIn dio0;
+        InterruptIn dio1;
+        InterruptIn dio3;
+        DigitalOut m_cs;
+        SPI& m_spi;
+
+    private:
+        DigitalInOut reset_pin;
+        bool has_dio3;
+#if DEVICE_SPI_ASYNCH
+        void spi_event(int events);
+        Callback<void()> async_done;
+#endif
+};
+#endif /* !SX127X_HOST */
+
+#endif /* SX127x_HAL_H */
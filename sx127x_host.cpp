@@ -0,0 +1,258 @@
+#include "sx127x_host.h"
+#include "sx127x_instr.h"
+
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef SX127X_HOST
+
+SX127x_regfile::SX127x_regfile()
+{
+    reset();
+}
+
+void SX127x_regfile::reset()
+{
+    memset(regs, 0, sizeof(regs));
+    memset(dio_level, 0, sizeof(dio_level));
+    first = false;
+    wr = false;
+    addr = 0;
+}
+
+void SX127x_regfile::select(bool sel)
+{
+    first = sel;
+}
+
+uint8_t SX127x_regfile::transfer(uint8_t mosi)
+{
+    uint8_t ret = 0;
+
+    if (first) {
+        first = false;
+        wr = mosi & 0x80;
+        addr = mosi & 0x7f;
+        return 0;
+    }
+
+    if (wr)
+        regs[addr] = mosi;
+    else
+        ret = regs[addr];
+
+    if (addr != 0)  // fifo address doesnt increment
+        addr = (addr + 1) & 0x7f;
+
+    return ret;
+}
+
+int SX127x_regfile::dio(uint8_t n)
+{
+    if (n < sizeof(dio_level))
+        return dio_level[n];
+    return 0;
+}
+
+/*********************************************************************/
+
+SX127x_host_hal::SX127x_host_hal(SX127x_spi_device& dev) : spi_hz(3000000), m_dev(dev), clock_ns(0), dio_level(0), in_isr(false)
+{
+}
+
+void SX127x_host_hal::elapse_ns(uint64_t ns)
+{
+    clock_ns += ns;
+    m_dev.advance(now_us());
+    poll_dio();
+}
+
+void SX127x_host_hal::poll_dio()
+{
+    uint8_t n;
+
+    if (in_isr)
+        return;
+
+    for (n = 0; n < 6; n++) {
+        uint8_t bit = 1 << n;
+        if (!dio_isr[n] && !dio_fall_isr[n])
+            continue;
+        if (m_dev.dio(n)) {
+            if (!(dio_level & bit)) {
+                dio_level |= bit;
+                if (dio_isr[n]) {
+                    in_isr = true;
+                    dio_isr[n].call();
+                    in_isr = false;
+                }
+            }
+        } else if (dio_level & bit) {
+            dio_level &= ~bit;
+            if (dio_fall_isr[n]) {
+                in_isr = true;
+                dio_fall_isr[n].call();
+                in_isr = false;
+            }
+        }
+    }
+}
+
+bool SX127x_host_hal::attach_dio(uint8_t n, Callback<void()> isr)
+{
+    if (n >= 6)
+        return false;
+
+    dio_isr[n] = isr;
+    if (m_dev.dio(n))
+        dio_level |= 1 << n;    // already high: no edge
+    else
+        dio_level &= ~(1 << n);
+    return true;
+}
+
+bool SX127x_host_hal::attach_dio_fall(uint8_t n, Callback<void()> isr)
+{
+    if (n >= 6)
+        return false;
+
+    dio_fall_isr[n] = isr;
+    if (m_dev.dio(n))
+        dio_level |= 1 << n;
+    else
+        dio_level &= ~(1 << n);    // already low: no edge
+    return true;
+}
+
+void SX127x_host_hal::select(bool sel)
+{
+    if (sel)
+        SX127X_COUNT_CS();
+    m_dev.select(sel);
+}
+
+uint8_t SX127x_host_hal::transfer(uint8_t out)
+{
+    SX127X_COUNT_BYTES(1);
+    uint8_t in = m_dev.transfer(out);
+    elapse_ns(8000000000ULL / spi_hz);
+    return in;
+}
+
+int SX127x_host_hal::dio(uint8_t n)
+{
+    return m_dev.dio(n);
+}
+
+void SX127x_host_hal::hw_reset()
+{
+    m_dev.reset();
+    wait_us(10000);
+}
+
+void SX127x_host_hal::wait_us(uint32_t us)
+{
+    elapse_ns(us * 1000ULL);
+}
+
+uint32_t SX127x_host_hal::now_us()
+{
+    return clock_ns / 1000;
+}
+
+/*********************************************************************/
+
+SX127x_mock_hal::SX127x_mock_hal(SX127x_spi_device& dev) : SX127x_host_hal(dev), selected(false), first(false)
+{
+}
+
+void SX127x_mock_hal::select(bool sel)
+{
+    selected = sel;
+    first = sel;
+    SX127x_host_hal::select(sel);
+}
+
+uint8_t SX127x_mock_hal::transfer(uint8_t out)
+{
+    uint32_t start = now_us();
+    uint8_t in = SX127x_host_hal::transfer(out);
+
+    if (!selected)
+        return in;
+
+    if (first) {
+        SX127x_spi_xfer x;
+        x.start_us = start;
+        x.addr = out;
+        log.push_back(x);
+        first = false;
+    } else {
+        log.back().mosi.push_back(out);
+        log.back().miso.push_back(in);
+    }
+
+    return in;
+}
+
+void SX127x_mock_hal::clear()
+{
+    log.clear();
+}
+
+unsigned SX127x_mock_hal::bytes() const
+{
+    unsigned i, n = 0;
+
+    for (i = 0; i < log.size(); i++)
+        n += 1 + log[i].mosi.size();
+
+    return n;
+}
+
+unsigned SX127x_mock_hal::writes_to(uint8_t addr) const
+{
+    unsigned i, n = 0;
+
+    for (i = 0; i < log.size(); i++) {
+        const SX127x_spi_xfer& x = log[i];
+        uint8_t first_addr = x.addr & 0x7f;
+        if (!(x.addr & 0x80))
+            continue;
+        if (first_addr == 0) {
+            if (addr == 0)
+                n++;
+        } else if (addr >= first_addr && addr < first_addr + x.mosi.size())
+            n++;
+    }
+
+    return n;
+}
+
+void SX127x_mock_hal::dump() const
+{
+    unsigned i, j;
+
+    for (i = 0; i < log.size(); i++) {
+        const SX127x_spi_xfer& x = log[i];
+        printf("%8u %c%02x:", (unsigned)x.start_us, (x.addr & 0x80) ? 'W' : 'R', x.addr & 0x7f);
+        for (j = 0; j < x.mosi.size(); j++)
+            printf(" %02x", (x.addr & 0x80) ? x.mosi[j] : x.miso[j]);
+        printf("\r\n");
+    }
+}
+
+#endif /* SX127X_HOST */
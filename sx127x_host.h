@@ -0,0 +1,140 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_HOST_H
+#define SX127x_HOST_H
+
+/* host (linux) build of the driver, compile with -DSX127X_HOST */
+#ifdef SX127X_HOST
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include "sx127x_hal.h"
+
+/** radio side of the SPI bus, driven by SX127x_host_hal */
+class SX127x_spi_device {
+    public:
+        virtual ~SX127x_spi_device() { }
+
+        /** chip select edge, true=selected */
+        virtual void select(bool sel) = 0;
+
+        /** one byte clocked while selected */
+        virtual uint8_t transfer(uint8_t mosi) = 0;
+
+        virtual int dio(uint8_t n) = 0;
+
+        virtual void reset(void) { }
+
+        /** simulated time moved forward to now_us */
+        virtual void advance(uint32_t now_us) { (void)now_us; }
+};
+
+/** flat 128 register device with address auto-increment; DIO levels set by test code */
+class SX127x_regfile : public SX127x_spi_device {
+    public:
+        SX127x_regfile();
+
+        void select(bool sel);
+        uint8_t transfer(uint8_t mosi);
+        int dio(uint8_t n);
+        void reset(void);
+
+        uint8_t regs[0x80];
+        uint8_t dio_level[6];
+
+    private:
+        bool first;
+        bool wr;
+        uint8_t addr;
+};
+
+/** host backend: simulated microsecond clock.
+ * wait_us() advances the clock without sleeping, SPI bytes are charged to the clock at spi_hz.
+ */
+class SX127x_host_hal : public SX127x_hal {
+    public:
+        SX127x_host_hal(SX127x_spi_device& dev);
+
+        using SX127x_hal::transfer;
+        void select(bool sel);
+        uint8_t transfer(uint8_t out);
+        int dio(uint8_t n);
+        bool attach_dio(uint8_t n, Callback<void()> isr);
+        bool attach_dio_fall(uint8_t n, Callback<void()> isr);
+        void hw_reset(void);
+        void wait_us(uint32_t us);
+        uint32_t now_us(void);
+
+        //! SPI clock used to charge bus time, same as mbed backend default
+        uint32_t spi_hz;
+
+        SX127x_spi_device& m_dev;
+
+    protected:
+        void elapse_ns(uint64_t ns);
+        uint64_t clock_ns;
+
+    private:
+        /* DIO edges are detected each time the clock moves, ISRs run synchronously */
+        void poll_dio(void);
+        Callback<void()> dio_isr[6];
+        Callback<void()> dio_fall_isr[6];
+        uint8_t dio_level;  // bitmap, last level seen of pins with an isr
+        bool in_isr;
+};
+
+/** one chip select cycle seen by SX127x_mock_hal */
+struct SX127x_spi_xfer {
+    uint32_t start_us;
+    uint8_t addr;                   // first byte: bit7 set for write
+    std::vector<uint8_t> mosi;      // bytes following address
+    std::vector<uint8_t> miso;
+};
+
+/** host backend recording every SPI transaction */
+class SX127x_mock_hal : public SX127x_host_hal {
+    public:
+        SX127x_mock_hal(SX127x_spi_device& dev);
+
+        using SX127x_hal::transfer;
+        void select(bool sel);
+        uint8_t transfer(uint8_t out);
+
+        void clear(void);
+
+        /** count of bytes clocked, address bytes included */
+        unsigned bytes(void) const;
+
+        /** count of transactions which wrote to addr (as first or auto-incremented register) */
+        unsigned writes_to(uint8_t addr) const;
+
+        /** print log to stdout */
+        void dump(void) const;
+
+        std::vector<SX127x_spi_xfer> log;
+
+    private:
+        bool selected;
+        bool first;
+};
+
+#endif /* SX127X_HOST */
+
+#endif /* SX127x_HOST_H */
@@ -0,0 +1,83 @@
+#include "sx127x_instr.h"
+
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef SX127X_INSTRUMENT
+
+#include <stdio.h>
+#include <string.h>
+
+SX127x_op_stats sx127x_op_stats[SX127X_OP_COUNT];
+SX127x_bus_counters sx127x_bus;
+
+#define SX127X_OP_NAME(name)    #name,
+static const char* const op_names[SX127X_OP_COUNT] = {
+    SX127X_OPS(SX127X_OP_NAME)
+};
+#undef SX127X_OP_NAME
+
+SX127x_probe::SX127x_probe(sx127x_op_e op, SX127x_hal& hal) : m_op(op), m_hal(hal)
+{
+    start = sx127x_bus;
+    start_us = m_hal.now_us();
+}
+
+SX127x_probe::~SX127x_probe()
+{
+    SX127x_op_stats& s = sx127x_op_stats[m_op];
+    uint32_t us = m_hal.now_us() - start_us;
+    unsigned b = 0;
+
+    while (b < SX127X_HIST_BUCKETS-1 && (us >> b) != 0)
+        b++;
+
+    s.calls++;
+    s.transactions += sx127x_bus.transactions - start.transactions;
+    s.cs_cycles += sx127x_bus.cs_cycles - start.cs_cycles;
+    s.bytes += sx127x_bus.bytes - start.bytes;
+    s.us_total += us;
+    if (us > s.us_max)
+        s.us_max = us;
+    s.hist[b]++;
+}
+
+void sx127x_instr_dump()
+{
+    unsigned op, b;
+
+    printf("%-22s %8s %8s %8s %8s %10s %8s %8s\r\n", "op", "calls", "xact", "cs", "bytes", "us", "us/call", "max");
+    for (op = 0; op < SX127X_OP_COUNT; op++) {
+        const SX127x_op_stats& s = sx127x_op_stats[op];
+        if (s.calls == 0)
+            continue;
+        printf("%-22s %8lu %8lu %8lu %8lu %10lu %8lu %8lu\r\n", op_names[op],
+            (unsigned long)s.calls, (unsigned long)s.transactions, (unsigned long)s.cs_cycles,
+            (unsigned long)s.bytes, (unsigned long)s.us_total,
+            (unsigned long)(s.us_total / s.calls), (unsigned long)s.us_max);
+        printf("    hist(log2 us):");
+        for (b = 0; b < SX127X_HIST_BUCKETS; b++)
+            printf(" %lu", (unsigned long)s.hist[b]);
+        printf("\r\n");
+    }
+}
+
+void sx127x_instr_reset()
+{
+    memset(sx127x_op_stats, 0, sizeof(sx127x_op_stats));
+}
+
+#endif /* SX127X_INSTRUMENT */
@@ -0,0 +1,116 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_INSTR_H
+#define SX127x_INSTR_H
+
+/* per-operation SPI traffic and latency accounting, compile with -DSX127X_INSTRUMENT.
+ * Without it every macro below expands to nothing. */
+
+#include "sx127x_hal.h"
+
+/* X(op): driver operations measured, in dump order */
+#define SX127X_OPS(X) \
+    X(init)                 \
+    X(hw_reset)             \
+    X(set_opmode)           \
+    X(set_frf_MHz)          \
+    X(flush)                \
+    X(lora_enable)          \
+    X(lora_setBw)           \
+    X(lora_setSf)           \
+    X(lora_setCodingRate)   \
+    X(lora_set_profile)     \
+    X(lora_start_tx)        \
+    X(lora_start_rx)        \
+    X(lora_service)         \
+    X(fsk_enable)           \
+    X(fsk_init)             \
+    X(fsk_set_bitrate)      \
+    X(fsk_set_tx_fdev_hz)   \
+    X(fsk_set_rx_dcc_bw_hz) \
+    X(fsk_set_rx_afc_bw_hz) \
+    X(fsk_start_tx)         \
+    X(fsk_start_rx)         \
+    X(fsk_seq_start)        \
+    X(fsk_service)
+
+#define SX127X_OP_ENUM(name)    SX127X_OP_##name,
+typedef enum {
+    SX127X_OPS(SX127X_OP_ENUM)
+    SX127X_OP_COUNT
+} sx127x_op_e;
+#undef SX127X_OP_ENUM
+
+#ifdef SX127X_INSTRUMENT
+
+#define SX127X_HIST_BUCKETS     16
+
+/** totals for one operation, nested operations are counted in their caller too */
+struct SX127x_op_stats {
+    uint32_t calls;
+    uint32_t transactions;  // register/FIFO accesses requested, shadow hits included
+    uint32_t cs_cycles;     // chip selects actually on the bus
+    uint32_t bytes;         // SPI bytes, address bytes included
+    uint32_t us_total;
+    uint32_t us_max;
+    uint32_t hist[SX127X_HIST_BUCKETS];    // [0]: 0us, [i]: 2^(i-1) to 2^i-1 us, last bucket open-ended
+};
+
+/** running bus counters, sampled by SX127x_probe */
+struct SX127x_bus_counters {
+    uint32_t transactions;
+    uint32_t cs_cycles;
+    uint32_t bytes;
+};
+
+extern SX127x_op_stats sx127x_op_stats[SX127X_OP_COUNT];
+extern SX127x_bus_counters sx127x_bus;
+
+/** measures one operation from construction to end of scope */
+class SX127x_probe {
+    public:
+        SX127x_probe(sx127x_op_e op, SX127x_hal& hal);
+        ~SX127x_probe();
+
+    private:
+        sx127x_op_e m_op;
+        SX127x_hal& m_hal;
+        uint32_t start_us;
+        SX127x_bus_counters start;
+};
+
+/** print table of operation statistics */
+void sx127x_instr_dump(void);
+
+/** zero all statistics */
+void sx127x_instr_reset(void);
+
+#define SX127X_PROBE(op, hal)   SX127x_probe sx127x_probe_(SX127X_OP_##op, hal)
+#define SX127X_COUNT_XACT()     (sx127x_bus.transactions++)
+#define SX127X_COUNT_CS()       (sx127x_bus.cs_cycles++)
+#define SX127X_COUNT_BYTES(n)   (sx127x_bus.bytes += (n))
+
+#else
+
+#define SX127X_PROBE(op, hal)
+#define SX127X_COUNT_XACT()     do { } while (0)
+#define SX127X_COUNT_CS()       do { } while (0)
+#define SX127X_COUNT_BYTES(n)   do { } while (0)
+
+#endif /* SX127X_INSTRUMENT */
+
+#endif /* SX127x_INSTR_H */
@@ -18,11 +18,38 @@
 
 SX127x_lora::SX127x_lora(SX127x& r) : m_xcvr(r)
 {
+    rx_meta = RX_META_ALL;
+    rx_ring = NULL;
+    poll_vh = false;
+    lbt_cads_left = 0;
+    lbt_backoff = false;
+    rng = 0x2545f491;
+    hop_frf = NULL;
+    hop_count = 0;
+    hop_index = 0;
+    sniff_period_us = 0;
+    sniff_sleep = false;
+    memset(&stats, 0, sizeof(stats));
+    hw_headers = 0;
+    hw_packets = 0;
+    rx_stream = false;
+    rx_stream_chunk = 16;
+    rx_streamed = 0;
+    rx_stream_len = 0;
+    rx_stream_pos = 0;
+    txq_head = 0;
+    txq_count = 0;
+    txq_base = 0;
+    txq_used = 0;
+
     if (!m_xcvr.RegOpMode.bits.LongRangeMode)
         enable();
         
     RegModemConfig.octet = m_xcvr.read_reg(REG_LR_MODEMCONFIG);
     RegModemConfig2.octet = m_xcvr.read_reg(REG_LR_MODEMCONFIG2);
+    RegModemConfig3.octet = m_xcvr.read_reg(REG_LR_MODEMCONFIG3);
+    RegPreamble = m_xcvr.read_u16(REG_LR_PREAMBLEMSB);
+    RegTest31.octet = m_xcvr.read_reg(REG_LR_TEST31);
     RegTest33.octet = m_xcvr.read_reg(REG_LR_TEST33);     // invert_i_q
     RegDriftInvert.octet = m_xcvr.read_reg(REG_LR_DRIFT_INVERT);
     RegGainDrift.octet = m_xcvr.read_reg(REG_LR_GAIN_DRIFT);
@@ -38,33 +65,61 @@ SX127x_lora::~SX127x_lora()
 {
 }
     
+#ifndef SX127X_NO_PKT_BUFS
 void SX127x_lora::write_fifo(uint8_t len)
 {
-    int i;
-    
-    m_xcvr.m_cs = 0;
-    m_xcvr.m_spi.write(REG_FIFO | 0x80); // bit7 is high for writing to radio
-    
-    for (i = 0; i < len; i++) {
-        m_xcvr.m_spi.write(m_xcvr.tx_buf[i]);
-    }
-    m_xcvr.m_cs = 1;
+    write_fifo(m_xcvr.tx_buf, len);
 }
 
 void SX127x_lora::read_fifo(uint8_t len)
 {
-    int i;
-     
-    m_xcvr.m_cs = 0;
-    m_xcvr.m_spi.write(REG_FIFO); // bit7 is low for reading from radio
-    for (i = 0; i < len; i++) {
-        m_xcvr.rx_buf[i] = m_xcvr.m_spi.write(0);
-    }
-    m_xcvr.m_cs = 1;
+    read_fifo(m_xcvr.rx_buf, len);
+}
+
+void SX127x_lora::write_fifo_async(uint8_t len, Callback<void()> done)
+{
+    write_fifo_async(m_xcvr.tx_buf, len, done);
+}
+
+void SX127x_lora::read_fifo_async(uint8_t len, Callback<void()> done)
+{
+    read_fifo_async(m_xcvr.rx_buf, len, done);
+}
+
+void SX127x_lora::start_tx(uint8_t len)
+{
+    start_tx(m_xcvr.tx_buf, len);
+}
+
+void SX127x_lora::start_tx_lbt(uint8_t len, uint8_t max_cad)
+{
+    start_tx_lbt(m_xcvr.tx_buf, len, max_cad);
+}
+#endif /* !SX127X_NO_PKT_BUFS */
+
+void SX127x_lora::write_fifo(const uint8_t* buf, uint8_t len)
+{
+    m_xcvr.WriteBuffer(REG_FIFO, buf, len);
+}
+
+void SX127x_lora::read_fifo(uint8_t* buf, uint8_t len)
+{
+    m_xcvr.ReadBuffer(REG_FIFO, buf, len);
+}
+
+void SX127x_lora::write_fifo_async(const uint8_t* buf, uint8_t len, Callback<void()> done)
+{
+    m_xcvr.WriteBufferAsync(REG_FIFO, buf, len, done);
+}
+
+void SX127x_lora::read_fifo_async(uint8_t* buf, uint8_t len, Callback<void()> done)
+{
+    m_xcvr.ReadBufferAsync(REG_FIFO, buf, len, done);
 }
 
 void SX127x_lora::enable()
 {
+    SX127X_PROBE(lora_enable, m_xcvr.m_hal);
     m_xcvr.set_opmode(RF_OPMODE_SLEEP);
     
     m_xcvr.RegOpMode.bits.LongRangeMode = 1;
@@ -100,6 +155,7 @@ uint8_t SX127x_lora::getCodingRate(bool from_rx)
 
 void SX127x_lora::setCodingRate(uint8_t cr)
 {
+    SX127X_PROBE(lora_setCodingRate, m_xcvr.m_hal);
     if (!m_xcvr.RegOpMode.bits.LongRangeMode)
         return;
         
@@ -150,72 +206,66 @@ uint8_t SX127x_lora::getBw(void)
         return 0;
 }
 
+/* SX1276 Bw index of current bandwidth, SX1272 125/250/500KHz map to 7/8/9 */
+#define LORA_BW_INDEX() \
+    (m_xcvr.type == SX1272 ? 7 + RegModemConfig.sx1272bits.Bw : RegModemConfig.sx1276bits.Bw)
+
 int SX127x_lora::get_freq_error_Hz()
 {
-    int freq_error;
-    float f, khz = 0;
-    freq_error = m_xcvr.read_reg(REG_LR_TEST28);
+    int32_t freq_error;
+    uint8_t fei[3];
+
+    m_xcvr.ReadBuffer(REG_LR_TEST28, fei, 3);
+    freq_error = fei[0] & 0x0f;
     freq_error <<= 8;
-    freq_error += m_xcvr.read_reg(REG_LR_TEST29);
+    freq_error += fei[1];
     freq_error <<= 8;
-    freq_error += m_xcvr.read_reg(REG_LR_TEST2A);
+    freq_error += fei[2];
     if (freq_error & 0x80000) {  // 20bit value is negative
         //signed 20bit to 32bit
         freq_error |= 0xfff00000;
     }   
-    f = freq_error / (float)XTAL_FREQ;
-    f *= (float)0x1000000; // 2^24
-    if (m_xcvr.type == SX1272) {
-        switch (RegModemConfig.sx1272bits.Bw) {
-            case 0: khz = 125; break;
-            case 1: khz = 250; break;
-            case 2: khz = 500; break;                
-        }
-    } else if (m_xcvr.type == SX1276) {
-        switch (RegModemConfig.sx1276bits.Bw) {
-            case 0: khz = 7.8; break;
-            case 1: khz = 10.4; break;
-            case 2: khz = 15.6; break;
-            case 3: khz = 20.8; break;
-            case 4: khz = 31.25; break;
-            case 5: khz = 41.7; break;
-            case 6: khz = 62.5; break;
-            case 7: khz = 125; break;
-            case 8: khz = 250; break;
-            case 9: khz = 500; break;            
-        }
-    }
-    f *= khz / 500;
-    return (int)f;
+
+    if (m_xcvr.type != SX1272 && m_xcvr.type != SX1276)
+        return 0;
+    return lora_fei_to_hz(freq_error, LORA_BW_INDEX());
 }
 
 float SX127x_lora::get_symbol_period()
 {
-    float khz = 0;
-    
-    if (m_xcvr.type == SX1276) {
-        switch (RegModemConfig.sx1276bits.Bw) {
-            case 0: khz = 7.8; break;
-            case 1: khz = 10.4; break;
-            case 2: khz = 15.6; break;
-            case 3: khz = 20.8; break;
-            case 4: khz = 31.25; break;
-            case 5: khz = 41.7; break;
-            case 6: khz = 62.5; break;
-            case 7: khz = 125; break;
-            case 8: khz = 250; break;
-            case 9: khz = 500; break;
-        }
-    } else if (m_xcvr.type == SX1272) {
-        switch (RegModemConfig.sx1272bits.Bw) {
-            case 0: khz = 125; break;
-            case 1: khz = 250; break;
-            case 2: khz = 500; break;            
-        }
-    }
-    
     // return symbol duration in milliseconds
-    return (1 << RegModemConfig2.sx1276bits.SpreadingFactor) / khz; 
+    return get_symbol_us() / 1000.0f;
+}
+
+uint32_t SX127x_lora::get_symbol_us()
+{
+    return lora_symbol_us(RegModemConfig2.sx1276bits.SpreadingFactor, LORA_BW_INDEX());
+}
+
+SX127x_lora_airtime SX127x_lora::get_airtime()
+{
+    if (m_xcvr.type == SX1272) {
+        return SX127x_lora_airtime(RegModemConfig2.sx1272bits.SpreadingFactor, LORA_BW_INDEX(),
+            RegModemConfig.sx1272bits.CodingRate, RegPreamble,
+            RegModemConfig.sx1272bits.RxPayloadCrcOn, RegModemConfig.sx1272bits.ImplicitHeaderModeOn,
+            RegModemConfig.sx1272bits.LowDataRateOptimize);
+    } else {
+        return SX127x_lora_airtime(RegModemConfig2.sx1276bits.SpreadingFactor, LORA_BW_INDEX(),
+            RegModemConfig.sx1276bits.CodingRate, RegPreamble,
+            RegModemConfig2.sx1276bits.RxPayloadCrcOn, RegModemConfig.sx1276bits.ImplicitHeaderModeOn,
+            RegModemConfig3.sx1276bits.LowDataRateOptimize);
+    }
+}
+
+uint32_t SX127x_lora::get_airtime_us(uint8_t len)
+{
+    return get_airtime().us(len);
+}
+
+void SX127x_lora::set_preamble(uint16_t symbols)
+{
+    RegPreamble = symbols;
+    m_xcvr.write_u16(REG_LR_PREAMBLEMSB, RegPreamble);
 }
 
 void SX127x_lora::setBw_KHz(int khz)
@@ -244,26 +294,29 @@ void SX127x_lora::setBw_KHz(int khz)
 
 void SX127x_lora::setBw(uint8_t bw)
 {
+    SX127X_PROBE(lora_setBw, m_xcvr.m_hal);
     if (!m_xcvr.RegOpMode.bits.LongRangeMode)
         return;
         
+    m_xcvr.begin_transaction();
     if (m_xcvr.type == SX1276) {        
         RegModemConfig.sx1276bits.Bw = bw;
-        if (get_symbol_period() > 16)
+        if (get_symbol_us() > 16000)
             RegModemConfig3.sx1276bits.LowDataRateOptimize = 1;
         else
             RegModemConfig3.sx1276bits.LowDataRateOptimize = 0;
         m_xcvr.write_reg(REG_LR_MODEMCONFIG3, RegModemConfig3.octet);        
     } else if (m_xcvr.type == SX1272) {
         RegModemConfig.sx1272bits.Bw = bw;
-        if (get_symbol_period() > 16)
+        if (get_symbol_us() > 16000)
             RegModemConfig.sx1272bits.LowDataRateOptimize = 1;
         else
             RegModemConfig.sx1272bits.LowDataRateOptimize = 0;
-    } else
-        return;
+    }
         
-    m_xcvr.write_reg(REG_LR_MODEMCONFIG, RegModemConfig.octet);
+    if (m_xcvr.type != SX_NONE)
+        m_xcvr.write_reg(REG_LR_MODEMCONFIG, RegModemConfig.octet);
+    m_xcvr.end_transaction();
 }
 
 
@@ -284,9 +337,12 @@ void SX127x_lora::set_nb_trig_peaks(int n)
 
 void SX127x_lora::setSf(uint8_t sf)
 {
+    SX127X_PROBE(lora_setSf, m_xcvr.m_hal);
     if (!m_xcvr.RegOpMode.bits.LongRangeMode)
         return; 
 
+    m_xcvr.begin_transaction();
+
     // write register at 0x37 with value 0xc if at SF6
     if (sf < 7)
         m_xcvr.write_reg(REG_LR_DETECTION_THRESHOLD, 0x0c);
@@ -297,18 +353,20 @@ void SX127x_lora::setSf(uint8_t sf)
     m_xcvr.write_reg(REG_LR_MODEMCONFIG2, RegModemConfig2.octet);
     
     if (m_xcvr.type == SX1272) {
-        if (get_symbol_period() > 16)
+        if (get_symbol_us() > 16000)
             RegModemConfig.sx1272bits.LowDataRateOptimize = 1;
         else
             RegModemConfig.sx1272bits.LowDataRateOptimize = 0;
         m_xcvr.write_reg(REG_LR_MODEMCONFIG, RegModemConfig.octet);
     } else if (m_xcvr.type == SX1276) {
-        if (get_symbol_period() > 16)
+        if (get_symbol_us() > 16000)
             RegModemConfig3.sx1276bits.LowDataRateOptimize = 1;
         else
             RegModemConfig3.sx1276bits.LowDataRateOptimize = 0;
         m_xcvr.write_reg(REG_LR_MODEMCONFIG3, RegModemConfig3.octet);
     }
+
+    m_xcvr.end_transaction();
 }
 
 
@@ -365,6 +423,29 @@ void SX127x_lora::setAgcAutoOn(bool on)
     
 }
 
+bool SX127x_lora::set_profile(const SX127x_lora_profile& p)
+{
+    SX127X_PROBE(lora_set_profile, m_xcvr.m_hal);
+    if (!m_xcvr.RegOpMode.bits.LongRangeMode || p.type != m_xcvr.type)
+        return false;
+
+    RegModemConfig.octet = p.modem_config;
+    RegModemConfig2.octet = p.modem_config2 | (RegModemConfig2.octet & 0x0b);
+    RegTest31.bits.detect_trig_same_peaks_nb = p.trig_peaks;
+
+    m_xcvr.begin_transaction();
+    m_xcvr.write_reg(REG_LR_MODEMCONFIG, RegModemConfig.octet);
+    m_xcvr.write_reg(REG_LR_MODEMCONFIG2, RegModemConfig2.octet);
+    if (m_xcvr.type == SX1276) {
+        RegModemConfig3.octet = p.modem_config3 | (RegModemConfig3.octet & 0xf3);
+        m_xcvr.write_reg(REG_LR_MODEMCONFIG3, RegModemConfig3.octet);
+    }
+    m_xcvr.write_reg(REG_LR_TEST31, RegTest31.octet);
+    m_xcvr.write_reg(REG_LR_DETECTION_THRESHOLD, p.detection_threshold);
+    m_xcvr.end_transaction();
+    return true;
+}
+
 void SX127x_lora::invert_tx(bool inv)
 {
     RegTest33.bits.chirp_invert_tx = !inv;
@@ -380,30 +461,321 @@ void SX127x_lora::invert_rx(bool inv)
     m_xcvr.write_reg(REG_LR_DRIFT_INVERT, RegDriftInvert.octet);
 }
 
-void SX127x_lora::start_tx(uint8_t len)
-{                   
+/* payload to FIFO at TxBase, radio mode unchanged */
+void SX127x_lora::load_tx(const uint8_t* buf, uint8_t len)
+{
+    // set FifoPtrAddr to FifoTxPtrBase
+    m_xcvr.write_reg(REG_LR_FIFOADDRPTR, m_xcvr.read_reg(REG_LR_FIFOTXBASEADDR));
+    
+    // write PayloadLength bytes to fifo
+    write_fifo(buf, len);
+
+    RegPayloadLength = len;
+    m_xcvr.write_reg(REG_LR_PAYLOADLENGTH, RegPayloadLength);  // shadow skips it when unchanged
+}
+
+void SX127x_lora::transmit()
+{
     // DIO0 to TxDone
     if (m_xcvr.RegDioMapping1.bits.Dio0Mapping != 1) {
         m_xcvr.RegDioMapping1.bits.Dio0Mapping = 1;
         m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
     }
-    
-    // set FifoPtrAddr to FifoTxPtrBase
-    m_xcvr.write_reg(REG_LR_FIFOADDRPTR, m_xcvr.read_reg(REG_LR_FIFOTXBASEADDR));
-    
-    // write PayloadLength bytes to fifo
-    write_fifo(len);
+
+    if (hop_count)
+        hop_start();
        
     m_xcvr.set_opmode(RF_OPMODE_TRANSMITTER);
 }
 
+/* frame at txq_head on air: its FIFO region becomes the TX base */
+void SX127x_lora::txq_send()
+{
+    m_xcvr.write_reg(REG_LR_FIFOTXBASEADDR, txq_base);
+    RegPayloadLength = txq_len[txq_head];
+    m_xcvr.write_reg(REG_LR_PAYLOADLENGTH, RegPayloadLength);  // shadow skips it when unchanged
+    transmit();
+}
+
+bool SX127x_lora::queue_tx(const uint8_t* buf, uint8_t len)
+{
+    uint8_t tail;
+
+    if (!m_xcvr.RegOpMode.bits.LongRangeMode)
+        return false;
+    if (txq_count == SX127X_TXQ_LEN || txq_used + len > 256)
+        return false;
+
+    if (txq_count == 0) {
+        /* idle: cancel whatever else was going on, frame goes out now */
+        lbt_cads_left = 0;
+        lbt_backoff = false;
+        sniff_period_us = 0;
+        sniff_sleep = false;
+        txq_base = m_xcvr.read_reg(REG_LR_FIFOTXBASEADDR);
+        txq_used = 0;
+    }
+
+    /* FIFO address wraps at 256: frames are contiguous modulo 256 */
+    m_xcvr.write_reg(REG_LR_FIFOADDRPTR, (uint8_t)(txq_base + txq_used));
+    write_fifo(buf, len);
+
+    tail = txq_head + txq_count;
+    if (tail >= SX127X_TXQ_LEN)
+        tail -= SX127X_TXQ_LEN;
+    txq_len[tail] = len;
+    txq_used += len;
+    if (txq_count++ == 0)
+        txq_send();
+
+    return true;
+}
+
+void SX127x_lora::start_tx(const uint8_t* buf, uint8_t len)
+{
+    SX127X_PROBE(lora_start_tx, m_xcvr.m_hal);
+    lbt_cads_left = 0;
+    lbt_backoff = false;
+    sniff_period_us = 0;
+    sniff_sleep = false;
+    txq_count = 0;
+
+    load_tx(buf, len);
+    transmit();
+}
+
+void SX127x_lora::start_tx_lbt(const uint8_t* buf, uint8_t len, uint8_t max_cad)
+{
+    if (!m_xcvr.RegOpMode.bits.LongRangeMode)
+        return;
+
+    /* CAD leaves the FIFO alone: payload is loaded once */
+    load_tx(buf, len);
+
+    sniff_period_us = 0;
+    sniff_sleep = false;
+    txq_count = 0;
+    lbt_cads_left = max_cad > 0 ? max_cad : 1;
+    lbt_busy = 0;
+    lbt_backoff = false;
+    lbt_slot_us = get_symbol_us() * 4;
+    cad();
+}
+
+void SX127x_lora::cad()
+{
+    if (hop_count)
+        hop_channel0();     // LBT senses the channel the packet starts on
+
+    if (m_xcvr.RegDioMapping1.bits.Dio0Mapping != 2 || m_xcvr.RegDioMapping1.bits.Dio1Mapping != 2) {
+        m_xcvr.RegDioMapping1.bits.Dio0Mapping = 2;    // CadDone
+        m_xcvr.RegDioMapping1.bits.Dio1Mapping = 2;    // CadDetected
+        m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
+    }
+
+    m_xcvr.set_opmode(RF_OPMODE_CAD);
+}
+
+void SX127x_lora::start_cad()
+{
+    if (!m_xcvr.RegOpMode.bits.LongRangeMode)
+        return;
+
+    lbt_cads_left = 0;
+    lbt_backoff = false;
+    sniff_period_us = 0;
+    sniff_sleep = false;
+    txq_count = 0;
+    cad();
+}
+
+void SX127x_lora::set_cad_detection(uint8_t peak_to_noise, uint8_t min_peak)
+{
+    m_xcvr.begin_transaction();
+    m_xcvr.write_reg(REG_LR_CAD_PEAK_TO_NOISE_RATIO, peak_to_noise);
+    m_xcvr.write_reg(REG_LR_CAD_MIN_PEAK, min_peak);
+    m_xcvr.end_transaction();
+}
+
+uint32_t SX127x_lora::get_random()
+{
+    chip_mode_e mode = (chip_mode_e)m_xcvr.RegOpMode.bits.Mode;
+    uint8_t i;
+
+    /* wideband RSSI LSBs are receiver noise only while the receiver runs */
+    if (mode != RF_OPMODE_RECEIVER) {
+        m_xcvr.set_opmode(RF_OPMODE_RECEIVER);
+        hw_headers = 0;     // radio counts from each transition into RX
+        hw_packets = 0;
+        m_xcvr.m_hal.wait_us(SX127X_RNG_SAMPLE_US);
+    }
+
+    /* xorshift keeps a sequence going if samples repeat */
+    for (i = 0; i < SX127X_RNG_SAMPLES; i++) {
+        if (i > 0)
+            m_xcvr.m_hal.wait_us(SX127X_RNG_SAMPLE_US);
+        rng ^= m_xcvr.read_reg(REG_LR_WIDEBAND_RSSI) ^ m_xcvr.m_hal.now_us();
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+    }
+
+    if (mode != RF_OPMODE_RECEIVER)
+        m_xcvr.set_opmode(mode);
+    return rng;
+}
+
+void SX127x_lora::set_hopping(const uint8_t (*frf)[3], uint8_t count, uint8_t period)
+{
+    hop_frf = frf;
+    hop_count = frf ? count : 0;
+
+    RegHopPeriod = hop_count ? period : 0;
+    m_xcvr.write_reg(REG_LR_HOPPERIOD, RegHopPeriod);
+
+    if (hop_count)
+        m_xcvr.dio1_fast = callback(this, &SX127x_lora::hop_isr);
+    else
+        m_xcvr.dio1_fast = Callback<void()>();
+}
+
+void SX127x_lora::hop_channel0()
+{
+    hop_index = 0;
+    m_xcvr.write_u24(REG_FRFMSB, (hop_frf[0][0] << 16) | (hop_frf[0][1] << 8) | hop_frf[0][2]);
+}
+
+/* first channel of packet, DIO1 to FhssChangeChannel */
+void SX127x_lora::hop_start()
+{
+    hop_channel0();
+
+    if (m_xcvr.RegDioMapping1.bits.Dio1Mapping != 1) {
+        m_xcvr.RegDioMapping1.bits.Dio1Mapping = 1;
+        m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
+    }
+}
+
+/* next channel must be in RegFrf before current hop period ends */
+void SX127x_lora::hop()
+{
+    RegIrqFlags_t clr;
+    uint8_t i = hop_index + 1;
+
+    if (i >= hop_count)
+        i = 0;
+    hop_index = i;
+    m_xcvr.write_now(REG_FRFMSB, hop_frf[i], 3);
+
+    clr.octet = 0;
+    clr.bits.FhssChangeChannel = 1;
+    m_xcvr.write_now(REG_LR_IRQFLAGS, &clr.octet, 1);
+}
+
+void SX127x_lora::hop_isr()
+{
+    SX127x_dio_event ev;
+
+    if (m_xcvr.RegDioMapping1.bits.Dio1Mapping != 1) {
+        /* CadDetected or RxTimeout: not a hop, queue it as SX127x::dio1_isr() would */
+        ev.dio = 1;
+        ev.t_us = m_xcvr.m_hal.now_us();
+        m_xcvr.dio_events.push(ev);
+        return;
+    }
+
+    m_xcvr.bus_isr(callback(this, &SX127x_lora::hop));
+}
+
+service_action_e SX127x_lora::lbt_cad_done()
+{
+    uint8_t exp;
+
+    if (!RegIrqFlags.bits.CadDetected) {
+        lbt_cads_left = 0;
+        transmit();
+        return SERVICE_NONE;    // TxDone to follow
+    }
+
+    if (--lbt_cads_left == 0)
+        return SERVICE_CHANNEL_BUSY;
+
+    /* binary exponential backoff: 1 to 2^n slots, n capped at 6 */
+    exp = lbt_busy < 6 ? lbt_busy + 1 : 6;
+    lbt_busy++;
+    lbt_wake_us = m_xcvr.m_hal.now_us() + (1 + get_random() % (1 << exp)) * lbt_slot_us;
+    lbt_backoff = true;
+    return SERVICE_NONE;
+}
+
 void SX127x_lora::start_rx(chip_mode_e mode)
 {
+    SX127X_PROBE(lora_start_rx, m_xcvr.m_hal);
     if (!m_xcvr.RegOpMode.bits.LongRangeMode)
         return; // fsk mode
+    lbt_cads_left = 0;
+    lbt_backoff = false;
+    sniff_period_us = 0;
+    sniff_sleep = false;
+    txq_count = 0;
+    receive(mode);
+}
+
+void SX127x_lora::set_symb_timeout(uint16_t symbols)
+{
+    if (symbols < 4)
+        symbols = 4;
+    else if (symbols > 0x3ff)
+        symbols = 0x3ff;
+
+    /* SymbTimeoutMsb shares RegModemConfig2 */
+    RegModemConfig2.sx1276bits.SymbTimeoutMsb = symbols >> 8;
+    m_xcvr.write_u16(REG_LR_MODEMCONFIG2, (RegModemConfig2.octet << 8) | (symbols & 0xff));
+}
+
+void SX127x_lora::start_sniff(uint16_t window_symbols)
+{
+    uint32_t sym_us;
+
+    if (!m_xcvr.RegOpMode.bits.LongRangeMode)
+        return;
+
+    lbt_cads_left = 0;
+    lbt_backoff = false;
+    txq_count = 0;
+    set_symb_timeout(window_symbols);
+
+    /* sync word and SFD follow the preamble: only RegPreamble symbols are there to catch */
+    sym_us = get_symbol_us();
+    if (RegPreamble <= window_symbols || (uint32_t)(RegPreamble - window_symbols) * sym_us <= SX127X_SNIFF_WAKE_US) {
+        /* preamble too short to sniff: plain continuous receive */
+        start_rx(RF_OPMODE_RECEIVER);
+        return;
+    }
+    sniff_period_us = (RegPreamble - window_symbols) * sym_us - SX127X_SNIFF_WAKE_US;
+
+    sniff_wake_us = m_xcvr.m_hal.now_us();
+    sniff_wake();
+}
+
+/* RX_SINGLE now, next wake one period after this one */
+void SX127x_lora::sniff_wake()
+{
+    uint32_t now = m_xcvr.m_hal.now_us();
+
+    sniff_sleep = false;
+    sniff_wake_us += sniff_period_us;
+    if ((int32_t)(now - sniff_wake_us) >= 0)
+        sniff_wake_us = now + sniff_period_us;  // serviced late, resynchronize
+    receive(RF_OPMODE_RECEIVER_SINGLE);
+}
+
+void SX127x_lora::receive(chip_mode_e mode)
+{
     if (m_xcvr.RegOpMode.sx1276LORAbits.AccessSharedReg)
         return; // fsk page
         
+    m_xcvr.begin_transaction();
     if (m_xcvr.type == SX1276) {
         if (RegModemConfig.sx1276bits.Bw == 9) {  // if 500KHz bw: improved tolerance of reference frequency error
             if (RegAutoDrift.bits.freq_to_time_drift_auto) {
@@ -444,15 +816,28 @@ void SX127x_lora::start_rx(chip_mode_e mode)
             set_nb_trig_peaks(5);
             break;
     }   
+    if (hop_count)
+        hop_start();
+    m_xcvr.end_transaction();
         
     m_xcvr.set_opmode(mode);
 
-    if (m_xcvr.RegDioMapping1.bits.Dio0Mapping != 0) {
-        m_xcvr.RegDioMapping1.bits.Dio0Mapping = 0;    // DIO0 to RxDone
+    RegDioMapping1_t map = m_xcvr.RegDioMapping1;
+    map.bits.Dio0Mapping = 0;    // DIO0 to RxDone
+    if (mode == RF_OPMODE_RECEIVER_SINGLE && !hop_count)
+        map.bits.Dio1Mapping = 0;    // DIO1 to RxTimeout
+    if (header_filter || rx_stream || poll_vh)
+        map.bits.Dio3Mapping = 1;    // DIO3 to ValidHeader
+    if (map.octet != m_xcvr.RegDioMapping1.octet) {
+        m_xcvr.RegDioMapping1 = map;
         m_xcvr.write_reg(REG_DIOMAPPING1, m_xcvr.RegDioMapping1.octet);
     }
     
-    m_xcvr.write_reg(REG_LR_FIFOADDRPTR, m_xcvr.read_reg(REG_LR_FIFORXBASEADDR));
+    rx_stream_pos = m_xcvr.read_reg(REG_LR_FIFORXBASEADDR);
+    rx_stream_len = 0;
+    hw_headers = 0;     // radio counts from each transition into RX
+    hw_packets = 0;
+    m_xcvr.write_reg(REG_LR_FIFOADDRPTR, rx_stream_pos);
 }
 
 int SX127x_lora::get_pkt_rssi()
@@ -478,45 +863,295 @@ int SX127x_lora::get_current_rssi()
         return v - 139;
 }
 
-service_action_e SX127x_lora::service()
+/* 16-bit radio counters into 32-bit totals: modular difference survives wraparound */
+void SX127x_lora::merge_counters(const uint8_t* cnt)
 {
-    if (m_xcvr.RegOpMode.bits.Mode == RF_OPMODE_RECEIVER) {
-        if (poll_vh) {
-            RegIrqFlags.octet = m_xcvr.read_reg(REG_LR_IRQFLAGS);
-            if (RegIrqFlags.bits.ValidHeader) {
-                RegIrqFlags.octet = 0;
-                RegIrqFlags.bits.ValidHeader = 1;
-                m_xcvr.write_reg(REG_LR_IRQFLAGS, RegIrqFlags.octet);
-                printf("VH\r\n");
-            }
+    uint16_t headers = (cnt[0] << 8) | cnt[1];
+    uint16_t packets = (cnt[2] << 8) | cnt[3];
+
+    stats.rx_headers += (uint16_t)(headers - hw_headers);
+    stats.rx_packets += (uint16_t)(packets - hw_packets);
+    hw_headers = headers;
+    hw_packets = packets;
+}
+
+void SX127x_lora::get_stats(SX127x_lora_stats& out, bool reset)
+{
+    out = stats;
+    if (reset)
+        memset(&stats, 0, sizeof(stats));
+}
+
+void SX127x_lora::read_rx_meta()
+{
+    /* 0x10->0x1c are contiguous: one burst from FifoRxCurrentAddr up to the last field wanted */
+    uint8_t buf[REG_LR_HOPCHANNEL - REG_LR_FIFORXCURRENTADDR + 1];
+    uint8_t last = REG_LR_RXNBBYTES;
+    uint8_t want = rx_ring ? (uint8_t)RX_META_ALL : rx_meta;
+
+    if (want & RX_META_HOPCHANNEL)
+        last = REG_LR_HOPCHANNEL;
+    else if (want & RX_META_RSSI)
+        last = REG_LR_PKTRSSIVALUE;
+    else if (want & RX_META_SNR)
+        last = REG_LR_PKTSNRVALUE;
+    else if (want & RX_META_MODEMSTAT)
+        last = REG_LR_MODEMSTAT;
+    else if (want & RX_META_COUNTERS)
+        last = REG_LR_RXPACKETCNTVALUE_LSB;
+
+    m_xcvr.ReadBuffer(REG_LR_FIFORXCURRENTADDR, buf, last - REG_LR_FIFORXCURRENTADDR + 1);
+
+#define RX_META(reg)    buf[(reg) - REG_LR_FIFORXCURRENTADDR]
+    RegFifoRxCurrentAddr = RX_META(REG_LR_FIFORXCURRENTADDR);
+    RegIrqFlags.octet = RX_META(REG_LR_IRQFLAGS);
+    RegRxNbBytes = RX_META(REG_LR_RXNBBYTES);
+    if (want & RX_META_MODEMSTAT)
+        RegModemStatus.octet = RX_META(REG_LR_MODEMSTAT);
+    if (want & RX_META_SNR)
+        RegPktSnrValue = RX_META(REG_LR_PKTSNRVALUE);
+    if (want & RX_META_RSSI)
+        RegPktRssiValue = RX_META(REG_LR_PKTRSSIVALUE);
+    if (want & RX_META_HOPCHANNEL)
+        RegHopChannel.octet = RX_META(REG_LR_HOPCHANNEL);
+    if (last >= REG_LR_RXPACKETCNTVALUE_LSB)
+        merge_counters(&RX_META(REG_LR_RXHEADERCNTVALUE_MSB));  // in the burst anyway
+#undef RX_META
+}
+
+/* @returns false if packet is left in radio FIFO */
+bool SX127x_lora::rx_to_ring()
+{
+    SX127x_rx_pkt* pkt = rx_ring->claim();
+
+    if (!pkt)
+        return false;   // ring full, packet left in radio FIFO
+#if SX127X_PKT_MAX < 255
+    if (RegRxNbBytes > SX127X_PKT_MAX) {
+        rx_ring->dropped++;
+        return true;
+    }
+#endif
+
+    read_fifo(pkt->payload, RegRxNbBytes);
+    pkt->len = RegRxNbBytes;
+    pkt->t_us = m_xcvr.dio_time_us[0];
+    pkt->rssi_dbm = get_pkt_rssi();
+    pkt->snr_x4 = RegPktSnrValue;
+    pkt->freq_error_hz = get_freq_error_Hz();
+    pkt->coding_rate = RegModemStatus.bits.RxCodingRate;
+    pkt->crc_ok = !RegIrqFlags.bits.PayloadCrcError;
+    rx_ring->commit();
+    return true;
+}
+
+/* RxTimeout is on DIO1 unless hopping has it for FhssChangeChannel: then only in RegIrqFlags */
+bool SX127x_lora::rx_timeout_pending()
+{
+    RegIrqFlags_t flags;
+
+    if (m_xcvr.RegDioMapping1.bits.Dio1Mapping == 0)
+        return m_xcvr.dio_pending(1);
+
+    flags.octet = m_xcvr.read_reg(REG_LR_IRQFLAGS);
+    return flags.bits.RxTimeout;
+}
+
+/* pull payload bytes already demodulated, once rx_stream_chunk of them (or the rest) are in */
+bool SX127x_lora::stream_chunk()
+{
+    uint8_t last = m_xcvr.read_reg(REG_LR_RXBYTEADDR);
+    uint8_t avail = last + 1 - rx_stream_pos;  // 256 byte FIFO: wraps with uint8_t
+    uint8_t left = rx_stream_len - rx_streamed;
+
+    if (avail > left)
+        avail = left;
+    if (avail == 0 || (avail < rx_stream_chunk && avail < left))
+        return false;
+
+    m_xcvr.write_reg(REG_LR_FIFOADDRPTR, rx_stream_pos);
+    read_fifo(m_xcvr.rx_dest + rx_streamed, avail);
+    rx_stream_pos += avail;
+    rx_streamed += avail;
+    return true;
+}
+
+/* decode header, let header_filter abandon the packet before its payload airtime */
+service_action_e SX127x_lora::valid_header()
+{
+    /* flags, length, counters, coding rate (0x18) and CRC-on (0x1c) in one burst */
+    uint8_t buf[REG_LR_HOPCHANNEL - REG_LR_IRQFLAGS + 1];
+    RegIrqFlags_t clr;
+    uint8_t mode;
+
+    m_xcvr.ReadBuffer(REG_LR_IRQFLAGS, buf, sizeof(buf));
+    RegIrqFlags.octet = buf[0];
+    RegRxNbBytes = buf[REG_LR_RXNBBYTES - REG_LR_IRQFLAGS];
+    RegModemStatus.octet = buf[REG_LR_MODEMSTAT - REG_LR_IRQFLAGS];
+    RegHopChannel.octet = buf[REG_LR_HOPCHANNEL - REG_LR_IRQFLAGS];
+    merge_counters(&buf[REG_LR_RXHEADERCNTVALUE_MSB - REG_LR_IRQFLAGS]);
+
+    clr.octet = 0;
+    clr.bits.ValidHeader = 1;
+    m_xcvr.write_reg(REG_LR_IRQFLAGS, clr.octet);
+
+    if (RegIrqFlags.bits.RxDone)
+        return SERVICE_NONE;    // serviced too late to save anything
+
+    rx_header.t_us = m_xcvr.dio_time_us[3];
+    rx_header.len = RegRxNbBytes;
+    rx_header.coding_rate = RegModemStatus.bits.RxCodingRate;
+    rx_header.crc_on = RegHopChannel.bits.RxPayloadCrcOn;
+    if (!header_filter || header_filter.call(rx_header)) {
+        if (rx_stream && m_xcvr.rx_dest && !rx_ring) {
+            rx_stream_len = rx_header.len;
+            rx_streamed = 0;
         }
+        return SERVICE_NONE;
+    }
+
+    stats.rx_aborted++;
+    mode = m_xcvr.RegOpMode.bits.Mode;
+    m_xcvr.set_opmode(RF_OPMODE_STANDBY);
+    m_xcvr.write_reg(REG_LR_IRQFLAGS, 0xff);
+    m_xcvr.dio_pending(0);  // RxDone can't follow, drop any stale edge
+
+    if (sniff_period_us) {
+        m_xcvr.set_opmode(RF_OPMODE_SLEEP);
+        sniff_sleep = true;
+    } else if (mode == RF_OPMODE_RECEIVER)
+        receive(RF_OPMODE_RECEIVER);
+    return SERVICE_RX_ABORTED;
+}
+
+service_action_e SX127x_lora::service()
+{
+    SX127X_PROBE(lora_service, m_xcvr.m_hal);
+    if (lbt_backoff) {
+        if ((int32_t)(m_xcvr.m_hal.now_us() - lbt_wake_us) < 0)
+            return SERVICE_NONE;
+        lbt_backoff = false;
+        cad();
+        return SERVICE_NONE;
+    }
+
+    if (sniff_sleep) {
+        if (m_xcvr.RegOpMode.bits.Mode != RF_OPMODE_SLEEP)
+            m_xcvr.set_opmode(RF_OPMODE_SLEEP);     // application has taken the packet from the FIFO
+        if ((int32_t)(m_xcvr.m_hal.now_us() - sniff_wake_us) < 0)
+            return SERVICE_NONE;
+        sniff_wake();
+        return SERVICE_NONE;
+    }
+
+    if (m_xcvr.RegOpMode.bits.Mode == RF_OPMODE_RECEIVER_SINGLE && rx_timeout_pending()) {
+        RegIrqFlags.octet = 0;
+        RegIrqFlags.bits.RxTimeout = 1;
+        m_xcvr.write_reg(REG_LR_IRQFLAGS, RegIrqFlags.octet);
+        stats.rx_timeout++;
+        m_xcvr.RegOpMode.bits.Mode = RF_OPMODE_STANDBY;    // radio returns to standby after RxTimeout
+        if (sniff_period_us == 0)
+            return SERVICE_RX_TIMEOUT;
+        m_xcvr.set_opmode(RF_OPMODE_SLEEP);
+        sniff_sleep = true;
+        return SERVICE_NONE;
+    }
+
+    /* polled hopping; with interrupts, hop_isr() has already done it */
+    if (hop_count && m_xcvr.RegDioMapping1.bits.Dio1Mapping == 1 && m_xcvr.dio_pending(1))
+        hop();
+
+    if (m_xcvr.RegDioMapping1.bits.Dio3Mapping == 1 && m_xcvr.dio_pending(3)) {
+        service_action_e ret = valid_header();
+        if (ret != SERVICE_NONE)
+            return ret;
     }
        
-    if (m_xcvr.dio0 == 0)
+    if (!m_xcvr.dio_pending(0)) {
+        if (rx_stream_len && stream_chunk())
+            return SERVICE_RX_PARTIAL;
         return SERVICE_NONE;
+    }
         
+    bool taken = true;  // received payload copied out of radio FIFO
     switch (m_xcvr.RegDioMapping1.bits.Dio0Mapping) {
         case 0: // RxDone
-            /* user checks for CRC error in IrqFlags */
-            RegIrqFlags.octet = m_xcvr.read_reg(REG_LR_IRQFLAGS);  // save flags
-            RegHopChannel.octet = m_xcvr.read_reg(REG_LR_HOPCHANNEL);
-            //printf("[%02x]", RegIrqFlags.octet);
+            read_rx_meta();
             m_xcvr.write_reg(REG_LR_IRQFLAGS, RegIrqFlags.octet); // clear flags in radio
-            
-            /* any register of interest on received packet is read(saved) here */        
-            RegModemStatus.octet = m_xcvr.read_reg(REG_LR_MODEMSTAT);          
-            RegPktSnrValue = m_xcvr.read_reg(REG_LR_PKTSNRVALUE);
-            RegPktRssiValue = m_xcvr.read_reg(REG_LR_PKTRSSIVALUE);
-            RegRxNbBytes = m_xcvr.read_reg(REG_LR_RXNBBYTES);
+            /* user checks for CRC error in IrqFlags */
+            if (RegIrqFlags.bits.PayloadCrcError)
+                stats.rx_crc_error++;
+            else
+                stats.rx_ok++;
+            stats.rx_bytes += RegRxNbBytes;
+            stats.rx_airtime_us += get_airtime_us(RegRxNbBytes);
     
-            m_xcvr.write_reg(REG_LR_FIFOADDRPTR, m_xcvr.read_reg(REG_LR_FIFORXCURRENTADDR));
-            read_fifo(RegRxNbBytes);
+            if (rx_stream_len && RegRxNbBytes == rx_stream_len &&
+                RegFifoRxCurrentAddr == (uint8_t)(rx_stream_pos - rx_streamed))
+            {
+                /* streamed during reception: only the tail is left */
+                m_xcvr.write_reg(REG_LR_FIFOADDRPTR, rx_stream_pos);
+                read_fifo(m_xcvr.rx_dest + rx_streamed, RegRxNbBytes - rx_streamed);
+            } else {
+                m_xcvr.write_reg(REG_LR_FIFOADDRPTR, RegFifoRxCurrentAddr);
+                if (rx_ring)
+                    taken = rx_to_ring();
+                else if (m_xcvr.rx_dest)
+                    read_fifo(m_xcvr.rx_dest, RegRxNbBytes);
+                else
+                    taken = false;
+            }
+            rx_streamed = RegRxNbBytes;
+            rx_stream_len = 0;
+            rx_stream_pos = RegFifoRxCurrentAddr + RegRxNbBytes;   // RX continuous: next packet follows
+            if (hop_count && m_xcvr.RegOpMode.bits.Mode == RF_OPMODE_RECEIVER)
+                hop_start();    // next packet starts on first channel
+            if (sniff_period_us) {
+                /* RX_SINGLE ended in standby: sleep until next wake, once FIFO is no longer needed */
+                m_xcvr.RegOpMode.bits.Mode = RF_OPMODE_STANDBY;
+                if (taken)
+                    m_xcvr.set_opmode(RF_OPMODE_SLEEP);
+                sniff_sleep = true;
+            }
             return SERVICE_READ_FIFO;
         case 1: // TxDone
             RegIrqFlags.octet = 0;
             RegIrqFlags.bits.TxDone = 1;
             m_xcvr.write_reg(REG_LR_IRQFLAGS, RegIrqFlags.octet);                  
+            m_xcvr.RegOpMode.bits.Mode = RF_OPMODE_STANDBY;    // radio returns to standby after TX
+            {
+                uint8_t len = m_xcvr.read_reg(REG_LR_PAYLOADLENGTH);   // from shadow
+                stats.tx_done++;
+                stats.tx_bytes += len;
+                stats.tx_airtime_us += get_airtime_us(len);
+            }
+            if (txq_count > 0) {
+                /* next frame already in FIFO: re-arm first, payload load was done during airtime */
+                txq_base += txq_len[txq_head];
+                txq_used -= txq_len[txq_head];
+                if (++txq_head == SX127X_TXQ_LEN)
+                    txq_head = 0;
+                if (--txq_count > 0)
+                    txq_send();
+            }
             return SERVICE_TX_DONE;        
+        case 2: // CadDone
+            RegIrqFlags.octet = m_xcvr.read_reg(REG_LR_IRQFLAGS);
+            {
+                RegIrqFlags_t clr;
+                clr.octet = 0;
+                clr.bits.CadDone = 1;
+                clr.bits.CadDetected = 1;
+                m_xcvr.write_reg(REG_LR_IRQFLAGS, clr.octet);
+            }
+            m_xcvr.dio_pending(1);  // CadDetected edge, already seen in flags
+            stats.cad_done++;
+            if (RegIrqFlags.bits.CadDetected)
+                stats.cad_detected++;
+            m_xcvr.RegOpMode.bits.Mode = RF_OPMODE_STANDBY;    // radio returns to standby after CAD
+            if (lbt_cads_left > 0)
+                return lbt_cad_done();
+            return SERVICE_CAD_DONE;
     } // ...switch (RegDioMapping1.bits.Dio0Mapping)
     
     return SERVICE_ERROR;    
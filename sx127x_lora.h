@@ -1,4 +1,5 @@
 #include "sx127x.h"
+#include "sx127x_airtime.h"
 
 // LoRa registers
 #define REG_LR_FIFOADDRPTR                          0x0d
@@ -184,6 +185,89 @@ typedef union {
 } RegDriftInvert_t;
 
 
+/** per-packet registers fetched at RxDone, in addition to IrqFlags, RxNbBytes and FifoRxCurrentAddr */
+typedef enum {
+    RX_META_MODEMSTAT   = 0x01, // RegModemStatus: received coding rate
+    RX_META_SNR         = 0x02, // RegPktSnrValue
+    RX_META_RSSI        = 0x04, // RegPktRssiValue
+    RX_META_HOPCHANNEL  = 0x08, // RegHopChannel: received CRC-on
+    RX_META_COUNTERS    = 0x10, // RegRxHeaderCnt, RegRxPacketCnt: merged into SX127x_lora_stats
+    RX_META_ALL         = 0x1f
+} rx_meta_e;
+
+/** complete LoRa modem setting for one chip type: final values of 0x1d, 0x1e, 0x26, 0x31 and 0x37,
+ * LowDataRateOptimize and SF6 detection settings included.  Constant-initialized under C++11,
+ * applied with SX127x_lora::set_profile().
+ */
+struct SX127x_lora_profile {
+    /**
+     * @param chip SX1272 or SX1276
+     * @param sf spreading factor 6 to 12
+     * @param bw SX1276 Bw index (0=7.8KHz ... 9=500KHz), SX1272 supports 7, 8, 9 only
+     * @param cr coding rate 1=4/5 ... 4=4/8
+     * @param crc RxPayloadCrcOn
+     * @param implicit implicit header mode
+     * @param agc_auto AgcAutoOn
+     */
+    SX127X_CONSTEXPR SX127x_lora_profile(type_e chip, uint8_t sf, uint8_t bw, uint8_t cr,
+                                         bool crc = true, bool implicit = false, bool agc_auto = true) :
+        type(chip),
+        modem_config(chip == SX1272 ?
+            (uint8_t)(((bw - 7) << 6) | (cr << 3) | (implicit << 2) | (crc << 1) | lora_ldro_needed(sf, bw)) :
+            (uint8_t)((bw << 4) | (cr << 1) | implicit)),
+        modem_config2((uint8_t)((sf << 4) | ((chip == SX1272 ? agc_auto : crc) << 2))),
+        modem_config3((uint8_t)((lora_ldro_needed(sf, bw) << 3) | (agc_auto << 2))),
+        trig_peaks(sf == 6 ? 3 : sf == 7 ? 4 : 5),
+        detection_threshold(sf < 7 ? 0x0c : 0x0a)
+    { }
+
+    type_e type;
+    uint8_t modem_config;       // 0x1d
+    uint8_t modem_config2;      // 0x1e, SymbTimeoutMsb and TxContinuousMode taken from radio
+    uint8_t modem_config3;      // 0x26 sx1276 only: LowDataRateOptimize, AgcAutoOn
+    uint8_t trig_peaks;         // 0x31 detect_trig_same_peaks_nb
+    uint8_t detection_threshold;    // 0x37
+};
+
+/** packet statistics kept by SX127x_lora::service(), 32-bit totals wrapping modulo 2^32 */
+struct SX127x_lora_stats {
+    uint32_t rx_ok;             // RxDone without CRC error
+    uint32_t rx_crc_error;      // RxDone with PayloadCrcError
+    uint32_t rx_timeout;        // RX_SINGLE RxTimeout, sniff wakes included
+    uint32_t rx_aborted;        // packets abandoned by header_filter
+    uint32_t rx_headers;        // radio's valid header counter
+    uint32_t rx_packets;        // radio's valid packet counter
+    uint32_t rx_bytes;          // payload bytes received
+    uint32_t rx_airtime_us;     // time on air of packets received
+    uint32_t tx_done;
+    uint32_t tx_bytes;          // payload bytes transmitted
+    uint32_t tx_airtime_us;     // time on air of packets transmitted
+    uint32_t cad_done;
+    uint32_t cad_detected;
+
+    /** @returns valid headers not followed by a good packet: lost to CRC error, abort or interference */
+    uint32_t rx_header_only(void) const { return rx_headers - rx_packets; }
+};
+
+#ifndef SX127X_TXQ_LEN
+#define SX127X_TXQ_LEN  4   // frames queue_tx() holds, including the one on air
+#endif
+
+#define SX127X_RNG_SAMPLES      4   // wideband RSSI reads per get_random()
+#define SX127X_RNG_SAMPLE_US    100 // between reads, and receiver settling before the first
+
+#ifndef SX127X_SNIFF_WAKE_US
+#define SX127X_SNIFF_WAKE_US    400 // sleep to receiving: oscillator 250, synthesizer 60, receiver 71
+#endif
+
+/** explicit header of packet being received, decoded at ValidHeader */
+struct SX127x_lora_header {
+    uint32_t t_us;          // ValidHeader edge
+    uint8_t len;            // payload length
+    uint8_t coding_rate;    // 1=4/5 ... 4=4/8
+    bool crc_on;            // payload carries CRC
+};
+
 //class SX127x_lora : public SX127x
 class SX127x_lora {
     public:
@@ -195,29 +279,163 @@ class SX127x_lora {
         /** changes from FSK mode to LoRa mdoe */
         void enable(void);
         
+#ifndef SX127X_NO_PKT_BUFS
         /** fills radio FIFO with payload contents, prior to transmission
          * @param len count of bytes to put into FIFO
          * @note tx_buf[] should contain desired payload (to send) prior to calling
          */
         void write_fifo(uint8_t len);     
         
-        /** transmit a packet
+        /** fills radio FIFO in background, see write_fifo()
+         * @param len count of bytes to put into FIFO
+         * @param done called when payload is in FIFO, possibly from interrupt context
+         */
+        void write_fifo_async(uint8_t len, Callback<void()> done);
+
+        /** transmit a packet, RegPayloadLength is set to len
          * @param len size of packet
          * @note Limited to (lora fifo size 256)
          */
         void start_tx(uint8_t len);
+#endif
+
+        /** fills radio FIFO from caller's buffer, no copy through tx_buf[]
+         * @param buf payload
+         * @param len count of bytes to put into FIFO
+         */
+        void write_fifo(const uint8_t* buf, uint8_t len);
+
+        /** fills radio FIFO from caller's buffer in background
+         * @param buf payload, must stay valid until done
+         * @param len count of bytes to put into FIFO
+         * @param done called when payload is in FIFO, possibly from interrupt context
+         */
+        void write_fifo_async(const uint8_t* buf, uint8_t len, Callback<void()> done);
+
+        /** transmit a packet from caller's buffer, RegPayloadLength is set to len
+         * @param buf payload
+         * @param len size of packet
+         */
+        void start_tx(const uint8_t* buf, uint8_t len);
+
+        /** back-to-back transmit: frames are staged one after another in the 256 byte FIFO
+         * while the previous frame is on air, then TX is re-armed from service() at TxDone
+         * by moving FifoTxBaseAddr, with no payload on the bus between frames.
+         * Starts transmitting at once if nothing is on air.  service() returns SERVICE_TX_DONE
+         * for each frame; tx_queued() tells if more follow.
+         * @param buf payload, copied to the FIFO before returning
+         * @param len size of packet
+         * @returns false if FIFO space or queue slots are used up: retry after SERVICE_TX_DONE
+         * @note start_tx(), start_rx(), start_sniff() and start_cad() discard the queue
+         */
+        bool queue_tx(const uint8_t* buf, uint8_t len);
+
+        /** @returns count of frames on air or waiting in FIFO from queue_tx() */
+        uint8_t tx_queued(void) const { return txq_count; }
+
+        /** listen-before-talk transmit: payload goes to FIFO, then CAD is run before transmitting.
+         * While the channel is busy, CAD is retried after a random binary exponential backoff,
+         * in slots of four symbols.  service() returns SERVICE_TX_DONE, or SERVICE_CHANNEL_BUSY
+         * once max_cad attempts all detected activity.
+         * @param buf payload
+         * @param len size of packet
+         * @param max_cad count of CAD attempts before giving up, at least 1
+         * @note service() must keep being called during backoff, see lbt_backoff
+         */
+        void start_tx_lbt(const uint8_t* buf, uint8_t len, uint8_t max_cad);
+#ifndef SX127X_NO_PKT_BUFS
+        void start_tx_lbt(uint8_t len, uint8_t max_cad);
+#endif
+
+        /** start channel activity detection: DIO0 to CadDone, DIO1 to CadDetected.
+         * service() returns SERVICE_CAD_DONE, radio back in standby. */
+        void start_cad(void);
+
+        /** CAD detector tuning
+         * @param peak_to_noise REG_LR_CAD_PEAK_TO_NOISE_RATIO
+         * @param min_peak REG_LR_CAD_MIN_PEAK
+         */
+        void set_cad_detection(uint8_t peak_to_noise, uint8_t min_peak);
+
+        /** frequency hopping: from the next start_tx()/start_rx(), the radio changes channel
+         * every period symbols and raises FhssChangeChannel on DIO1.  The next table entry is
+         * written from the DIO1 interrupt when SX127x::enable_dio_irq() is in use, otherwise
+         * from service(), which then must be called at least once per hop period.
+         * @param frf hop sequence as RegFrf bytes, see SX127X_FRF_BYTES(); entry 0 starts each packet and is
+         *            where CAD and listen-before-talk sense
+         * @param count entries in frf, 0 disables hopping
+         * @param period symbols per hop (RegHopPeriod)
+         * @note frf must stay valid while hopping; both ends need the same table and period
+         */
+        void set_hopping(const uint8_t (*frf)[3], uint8_t count, uint8_t period);
+
+        /** @returns random number, receiver wideband noise mixed into xorshift
+         * @note receiver is switched on for about SX127X_RNG_SAMPLES * SX127X_RNG_SAMPLE_US if not in RX continuous,
+         *       then previous mode restored */
+        uint32_t get_random(void);
+
+        //! listen-before-talk waiting out backoff: call service() at or after lbt_wake_us
+        bool lbt_backoff;
+        uint32_t lbt_wake_us;
         
         /** start continuous receive mode
          * @param mode RF_OPMODE_RECEIVER or RF_OPMODE_RECEIVER_SINGLE
          * @note the variable service_action needs to be monitored to indicate read_fifo() needs to be called to pull packet from FIFO.
+         * @note RF_OPMODE_RECEIVER_SINGLE: service() returns SERVICE_RX_TIMEOUT when no preamble is found within set_symb_timeout().
+         *       With set_hopping(), DIO1 carries FhssChangeChannel and RxTimeout has no interrupt: service() reads it
+         *       from RegIrqFlags, so it must be polled until the window has passed.
          */
         void start_rx(chip_mode_e mode);
+
+        /** RX_SINGLE window: preamble must be detected within this many symbols
+         * @param symbols 4 to 1023 (RegSymbTimeout)
+         */
+        void set_symb_timeout(uint16_t symbols);
+
+        /** duty-cycled receive for long-preamble wakeup frames.  The radio sleeps and wakes
+         * into RX_SINGLE once per sniff period, listening window_symbols each time.  The period is
+         * sized from RegPreamble so that every wake window lies inside the preamble at least once:
+         * (RegPreamble - window_symbols) symbols less SX127X_SNIFF_WAKE_US.  RxTimeout puts the radio back
+         * to sleep inside service(); received packets return SERVICE_READ_FIFO as usual and sniffing continues.
+         * The radio sleeps again once the packet is out of the FIFO: at once into rx_dest or rx_ring,
+         * otherwise at the next service() call.  start_rx(), start_tx() or start_cad() end sniffing.
+         * @param window_symbols symbol timeout of each wake, the transmitter's preamble must be much longer
+         * @note service() must keep being called while asleep, see sniff_sleep; with set_hopping(), also while
+         *       awake, see start_rx()
+         */
+        void start_sniff(uint16_t window_symbols);
+
+        //! sniffing between wakes: call service() at or after sniff_wake_us
+        bool sniff_sleep;
+        uint32_t sniff_wake_us;
         
+#ifndef SX127X_NO_PKT_BUFS
         /** Called by main program when indicated by service_action variable, to pull recevied packet from radio FIFO.
          * @returns count of bytes received
          * @note received packet in rx_buf[]
          */
         void read_fifo(uint8_t len);
+
+        /** pulls received packet into rx_buf[] in background, see read_fifo()
+         * @param len count of bytes to read
+         * @param done called when rx_buf[] holds the packet, possibly from interrupt context
+         */
+        void read_fifo_async(uint8_t len, Callback<void()> done);
+#endif
+
+        /** pull received packet from radio FIFO into caller's buffer
+         * @param buf destination, at least len bytes
+         * @param len count of bytes to read (RegRxNbBytes)
+         * @note with SX127x::rx_dest NULL, call this on SERVICE_READ_FIFO
+         */
+        void read_fifo(uint8_t* buf, uint8_t len);
+
+        /** pull received packet into caller's buffer in background
+         * @param buf destination, must stay valid until done
+         * @param len count of bytes to read
+         * @param done called when buf holds the packet, possibly from interrupt context
+         */
+        void read_fifo_async(uint8_t* buf, uint8_t len, Callback<void()> done);
         
         /** CodingRate: how much FEC to encoding onto packet */
         uint8_t getCodingRate(bool from_rx);    // false:transmitted, true:last recevied packet
@@ -246,6 +464,14 @@ class SX127x_lora {
         
         bool getAgcAutoOn(void);
         void setAgcAutoOn(bool);
+
+        /** apply complete modem setting in one transaction, replacing setBw(), setSf(),
+         * setCodingRate(), setHeaderMode(), setRxPayloadCrcOn() and setAgcAutoOn().
+         * Registers already holding the profile's value are not written.
+         * @param p profile built for the chip in use
+         * @returns false, nothing written, if not in LoRa mode or p is for the other chip type
+         */
+        bool set_profile(const SX127x_lora_profile& p);
         
         int get_pkt_rssi(void);
         int get_current_rssi(void);
@@ -254,10 +480,68 @@ class SX127x_lora {
          * @returns symbol duration in milliseconds
          */        
         float get_symbol_period(void);
+
+        /** @returns symbol duration in microseconds, exact */
+        uint32_t get_symbol_us(void);
+
+        /** airtime calculator for current modem configuration (SF, BW, CR, preamble, CRC, header mode, LDRO)
+         * @note keep the returned object while configuration is unchanged, its us(len) is cheap */
+        SX127x_lora_airtime get_airtime(void);
+
+        /** @returns time on air of len byte packet with current modem configuration, in microseconds */
+        uint32_t get_airtime_us(uint8_t len);
+
+        /** preamble length, kept in RegPreamble for get_airtime() and start_sniff()
+         * @param symbols programmed preamble (RegPreamble), the modem adds 4.25 */
+        void set_preamble(uint16_t symbols);
         
         service_action_e service(void); // (SLIH) ISR bottom half 
         
+        /*! when set, DIO3 is mapped to ValidHeader on each start_rx(), and service() decodes
+         * the explicit header into rx_header and passes it here.  Returning false abandons the
+         * packet at once, and the receiver listens again instead of demodulating the payload.
+         * Called from service(), not interrupt context.  Empty by default.
+         * @note DIO3 interrupt needs the pin wired (SX127x_mbed_hal dio_3), otherwise it is polled */
+        Callback<bool(const SX127x_lora_header&)> header_filter;
+
+        //! last header decoded for header_filter
+        SX127x_lora_header rx_header;
+
+        /*! @deprecated use header_filter.  When set, DIO3 is mapped to ValidHeader as with
+         * header_filter, and each header is decoded into rx_header with no filtering.
+         * Formerly polled RegIrqFlags on every service() call and printed "VH". */
         bool poll_vh;
+
+        /** copy of packet statistics, no bus access
+         * @param out receives the totals
+         * @param reset zero the totals after copying
+         * @note call from the context running service(), or with it held off: no locking inside
+         * @note radio header/packet counters are merged at each RxDone and ValidHeader read,
+         *       from the same burst that fetches the packet's registers (rx_meta RX_META_COUNTERS)
+         */
+        void get_stats(SX127x_lora_stats& out, bool reset = false);
+
+        /*! when set (explicit header mode, SX127x::rx_dest in use), payload is copied to rx_dest
+         * while the packet is still arriving: after ValidHeader on DIO3, service() follows the
+         * receiver's FIFO write position (RegFifoRxByteAddr) and returns SERVICE_RX_PARTIAL each
+         * time at least rx_stream_chunk more bytes were pulled.  At RxDone only the tail is read.
+         * @note service() must keep being called during reception */
+        bool rx_stream;
+
+        //! smallest read while streaming, fewer bytes wait for the next call (default 16)
+        uint8_t rx_stream_chunk;
+
+        //! payload bytes of current packet already in SX127x::rx_dest
+        uint8_t rx_streamed;
+
+        /** rx_meta_e bits: which packet registers service() reads at RxDone.
+         * All are read in the same burst, fewer fields make the burst shorter. */
+        uint8_t rx_meta;
+
+        /*! when set, service() reads each received packet and all its metadata into the next
+         * free slot, instead of to SX127x::rx_dest.  Receiving continues while the application
+         * consumes older packets.  NULL by default. */
+        SX127x_pkt_ring* rx_ring;
         
         void set_nb_trig_peaks(int);
         
@@ -274,6 +558,7 @@ class SX127x_lora {
         /** invert spectrum on receiver */
         void invert_rx(bool);
         
+        uint8_t             RegFifoRxCurrentAddr;   // 0x10
         RegIrqFlags_t       RegIrqFlags;            // 0x12
         uint8_t             RegRxNbBytes;           // 0x13
         RegModemStatus_t    RegModemStatus;         // 0x18
@@ -282,7 +567,7 @@ class SX127x_lora {
         RegHopChannel_t     RegHopChannel;          // 0x1c
         RegModemConfig_t    RegModemConfig;         // 0x1d
         RegModemConfig2_t   RegModemConfig2;        // 0x1e
-        uint16_t            RegPreamble;            // 0x20->0x21
+        uint16_t            RegPreamble;            // 0x20->0x21, read at construction, then kept by set_preamble()
         uint8_t             RegPayloadLength;       // 0x22
         uint8_t             RegRxMaxPayloadLength;  // 0x23
         uint8_t             RegHopPeriod;           // 0x24
@@ -297,5 +582,47 @@ class SX127x_lora {
         SX127x& m_xcvr;
 
     private:
+        void read_rx_meta(void);
+        void load_tx(const uint8_t* buf, uint8_t len);
+        void transmit(void);
+        void receive(chip_mode_e mode);
+        void sniff_wake(void);
+        bool rx_timeout_pending(void);
+        service_action_e valid_header(void);
+        bool stream_chunk(void);
+        void merge_counters(const uint8_t* cnt);
+
+        SX127x_lora_stats stats;
+        uint16_t hw_headers;    // radio counters at last merge, zeroed entering RX with them
+        uint16_t hw_packets;
+
+        void txq_send(void);
+
+        uint8_t txq_len[SX127X_TXQ_LEN];    // frames in FIFO order, [txq_head] on air
+        uint8_t txq_head;
+        uint8_t txq_count;
+        uint8_t txq_base;       // FIFO address of frame on air
+        uint16_t txq_used;      // FIFO bytes held by queued frames
+
+        uint8_t rx_stream_len;  // payload length from header, 0: not streaming
+        uint8_t rx_stream_pos;  // FIFO address of next byte to pull
+        void cad(void);
+        service_action_e lbt_cad_done(void);
+        void hop_channel0(void);
+        void hop_start(void);
+        void hop(void);
+        void hop_isr(void);
+
+        const uint8_t (*hop_frf)[3];
+        uint8_t hop_count;
+        volatile uint8_t hop_index;
+
+        uint32_t sniff_period_us;   // 0: not sniffing
+
+        uint8_t lbt_cads_left;  // 0: no listen-before-talk in progress
+        uint8_t lbt_busy;       // CAD attempts which found activity
+        uint32_t lbt_slot_us;
+        uint32_t rng;
+        bool rx_to_ring(void);
                                                                  
 };
@@ -0,0 +1,851 @@
+#include "sx127x_sim.h"
+
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef SX127X_HOST
+
+#include "sx127x_lora.h"
+#include "sx127x_fsk.h"
+
+#define OPMODE_LONGRANGE        0x80
+#define OPMODE_ACCESS_SHARED    0x40
+
+#define FSK_TX_DONE             -2  // fsk_tx_remaining: all bytes serialized, waiting for crc
+
+/* seq_state: sequencer state, idle and LowPower share one */
+#define SEQ_OFF                 0
+#define SEQ_LOWPOWER            1
+#define SEQ_TX                  2
+#define SEQ_RX                  3
+
+SX127x_sim::SX127x_sim(type_e t) : type(t)
+{
+    reset();
+}
+
+void SX127x_sim::reset()
+{
+    memset(common, 0, sizeof(common));
+    memset(lora_page, 0, sizeof(lora_page));
+    memset(fsk_page_regs, 0, sizeof(fsk_page_regs));
+    memset(lora_fifo, 0, sizeof(lora_fifo));
+
+    /* power-on defaults (datasheet) */
+    common[REG_OPMODE] = type == SX1276 ? 0x09 : 0x01;
+    common[REG_FRFMSB] = 0x6c;
+    common[REG_FRFMID] = 0x80;
+    common[REG_PACONFIG] = 0x4f;
+    common[REG_PARAMP] = 0x09;
+    common[REG_OCP] = 0x2b;
+    common[REG_LNA] = 0x20;
+    common[REG_VERSION] = type == SX1276 ? 0x12 : 0x22;
+
+    fsk_page_regs[REG_FSK_BITRATEMSB] = 0x1a;
+    fsk_page_regs[REG_FSK_BITRATELSB] = 0x0b;
+    fsk_page_regs[REG_FSK_FDEVLSB] = 0x52;
+    fsk_page_regs[REG_FSK_RXCONFIG] = 0x0e;
+    fsk_page_regs[REG_FSK_RSSICONFIG] = 0x02;
+    fsk_page_regs[REG_FSK_RSSICOLLISION] = 0x0a;
+    fsk_page_regs[REG_FSK_RSSITHRESH] = 0xff;
+    fsk_page_regs[REG_FSK_RXBW] = 0x15;
+    fsk_page_regs[REG_FSK_AFCBW] = 0x0b;
+    fsk_page_regs[REG_FSK_OOKPEAK] = 0x28;
+    fsk_page_regs[REG_FSK_OOKFIX] = 0x0c;
+    fsk_page_regs[REG_FSK_OOKAVG] = 0x12;
+    fsk_page_regs[REG_FSK_PREAMBLEDETECT] = 0x40;
+    fsk_page_regs[REG_FSK_OSC] = 0x05;
+    fsk_page_regs[REG_FSK_PREAMBLELSB] = 0x03;
+    fsk_page_regs[REG_FSK_SYNCCONFIG] = 0x93;
+    fsk_page_regs[REG_FSK_SYNCVALUE1] = 0x55;
+    fsk_page_regs[REG_FSK_PACKETCONFIG1] = 0x90;
+    fsk_page_regs[REG_FSK_PACKETCONFIG2] = 0x40;
+    fsk_page_regs[REG_FSK_PAYLOADLENGTH] = 0x40;
+    fsk_page_regs[REG_FSK_FIFOTHRESH] = 0x1f;
+    fsk_page_regs[REG_FSK_IMAGECAL] = 0x82;
+    fsk_page_regs[REG_FSK_LOWBAT] = 0x02;
+
+    lora_page[REG_LR_FIFOTXBASEADDR] = 0x80;
+    lora_page[REG_LR_MODEMCONFIG] = type == SX1276 ? 0x72 : 0x08;
+    lora_page[REG_LR_MODEMCONFIG2] = type == SX1276 ? 0x70 : 0x74;
+    lora_page[REG_LR_SYMBTIMEOUTLSB] = 0x64;
+    lora_page[REG_LR_PREAMBLELSB] = 0x08;
+    lora_page[REG_LR_PAYLOADLENGTH] = 0x01;
+    lora_page[REG_LR_RX_MAX_PAYLOADLENGTH] = 0xff;
+    lora_page[REG_LR_TEST31] = 0xc3;
+    lora_page[REG_LR_TEST33] = 0x27;
+    lora_page[REG_LR_DETECTION_THRESHOLD] = 0x0a;
+    lora_page[REG_LR_SYNC_BYTE] = 0x12;
+    lora_page[REG_LR_DRIFT_INVERT] = 0x1d;
+    lora_page[REG_LR_SX1276_AUTO_DRIFT] = 0x03;
+    lora_page[REG_LR_GAIN_DRIFT] = 0x24;
+
+    first = false;
+    wr = false;
+    addr = 0;
+    now = 0;
+    cad_busy = false;
+    hop_missed = 0;
+    fsk_tx_underrun = 0;
+    fsk_tx_starved = false;
+    transactions = 0;
+    bytes = 0;
+    rng = 0xace1;
+
+    rx_pending = false;
+    rx_written = 0;
+    rx_byte_ptr = 0;
+    rx_timeout_at = 0;
+    tx_end = 0;
+    cad_end = 0;
+    hop_next = 0;
+
+    fsk_head = 0;
+    fsk_count = 0;
+    fsk_tx_started = false;
+    fsk_tx_remaining = -1;
+    fsk_rx_active = false;
+    fsk_irq1 = 0;
+    fsk_irq2 = 0;
+    seq_state = SEQ_OFF;
+    seq_timer_end = 0;
+}
+
+bool SX127x_sim::lora() const
+{
+    return common[REG_OPMODE] & OPMODE_LONGRANGE;
+}
+
+bool SX127x_sim::fsk_page() const
+{
+    uint8_t op = common[REG_OPMODE];
+    return !(op & OPMODE_LONGRANGE) || (op & OPMODE_ACCESS_SHARED);
+}
+
+uint8_t* SX127x_sim::reg(uint8_t a)
+{
+    if ((a >= 0x02 && a <= 0x05) || (a >= 0x0d && a <= 0x3f))
+        return fsk_page() ? &fsk_page_regs[a] : &lora_page[a];
+    return &common[a];
+}
+
+uint8_t SX127x_sim::peek(uint8_t a)
+{
+    return *reg(a & 0x7f);
+}
+
+/*********************************************************************/
+
+void SX127x_sim::select(bool sel)
+{
+    first = sel;
+    if (sel)
+        transactions++;
+}
+
+uint8_t SX127x_sim::transfer(uint8_t mosi)
+{
+    uint8_t ret = 0;
+
+    bytes++;
+
+    if (first) {
+        first = false;
+        wr = mosi & 0x80;
+        addr = mosi & 0x7f;
+        return 0;
+    }
+
+    if (wr)
+        write(addr, mosi);
+    else
+        ret = read(addr);
+
+    if (addr != REG_FIFO)   // auto-increment, FIFO address stays put
+        addr = (addr + 1) & 0x7f;
+
+    return ret;
+}
+
+uint8_t SX127x_sim::read(uint8_t a)
+{
+    uint8_t mode = common[REG_OPMODE] & 7;
+
+    if (a == REG_FIFO) {
+        if (!lora())
+            return fsk_pop();
+        if (mode == RF_OPMODE_SLEEP)
+            return 0;
+        return lora_fifo[lora_page[REG_LR_FIFOADDRPTR]++];
+    }
+
+    if (fsk_page()) {
+        if (a == REG_FSK_IRQFLAGS1) {
+            RegIrqFlags1_t f;
+            f.octet = fsk_irq1;
+            f.bits.ModeReady = 1;
+            f.bits.RxReady = mode == RF_OPMODE_RECEIVER;
+            f.bits.TxReady = mode == RF_OPMODE_TRANSMITTER;
+            f.bits.PllLock = mode >= RF_OPMODE_SYNTHESIZER_TX;
+            return f.octet;
+        }
+        if (a == REG_FSK_IRQFLAGS2) {
+            RegIrqFlags2_t f;
+            RegFifoThreshold_t th;
+            th.octet = fsk_page_regs[REG_FSK_FIFOTHRESH];
+            f.octet = fsk_irq2;
+            f.bits.FifoFull = fsk_count == sizeof(fsk_fifo);
+            f.bits.FifoEmpty = fsk_count == 0;
+            f.bits.FifoLevel = fsk_count > th.bits.FifoThreshold;
+            return f.octet;
+        }
+    } else if (a == REG_LR_WIDEBAND_RSSI) {
+        /* wideband rssi is noise, commonly used as entropy */
+        rng ^= rng << 7;
+        rng ^= rng >> 9;
+        rng ^= rng << 8;
+        return rng;
+    }
+
+    return *reg(a);
+}
+
+void SX127x_sim::write(uint8_t a, uint8_t v)
+{
+    if (a == REG_FIFO) {
+        if (!lora())
+            fsk_push(v);
+        else if ((common[REG_OPMODE] & 7) != RF_OPMODE_SLEEP)
+            lora_fifo[lora_page[REG_LR_FIFOADDRPTR]++] = v;
+        return;
+    }
+
+    if (a == REG_OPMODE) {
+        write_opmode(v);
+        return;
+    }
+
+    if (a == REG_VERSION)
+        return;
+
+    if (fsk_page()) {
+        if (a == REG_FSK_IRQFLAGS1) {
+            fsk_irq1 &= ~(v & 0x0b);    // SyncAddressMatch, PreambleDetect, Rssi
+            return;
+        }
+        if (a == REG_FSK_IRQFLAGS2) {
+            RegIrqFlags2_t f;
+            f.octet = v;
+            if (f.bits.FifoOverrun) {
+                fsk_irq2 &= ~0x10;
+                fsk_count = 0;
+            }
+            if (f.bits.LowBat)
+                fsk_irq2 &= ~0x01;
+            return;
+        }
+        if (a == REG_FSK_SEQCONFIG1) {
+            RegSeqConfig1_t c;
+            c.octet = v;
+            fsk_page_regs[a] = v & 0x3f;    // start/stop are triggers
+            if (c.bits.SequencerStop) {
+                seq_state = SEQ_OFF;
+                seq_timer_end = 0;
+            } else if (c.bits.SequencerStart && seq_state == SEQ_OFF) {
+                seq_init_mode = common[REG_OPMODE] & 7;
+                switch (c.bits.FromStart) {
+                    case 0: seq_enter(SEQ_LOWPOWER); break;
+                    case 1: seq_enter(SEQ_RX); break;
+                    default: seq_enter(SEQ_TX); break;
+                }
+            }
+            return;
+        }
+        if (a == REG_FSK_RSSIVALUE || (a >= REG_FSK_AFCMSB && a <= REG_FSK_FEILSB) || a == REG_FSK_TEMP)
+            return; // read-only
+    } else {
+        if (a == REG_LR_IRQFLAGS) {
+            lora_page[REG_LR_IRQFLAGS] &= ~v;   // write 1 to clear
+            return;
+        }
+        if (a == REG_LR_FIFORXCURRENTADDR || (a >= REG_LR_RXNBBYTES && a <= REG_LR_HOPCHANNEL) || a == REG_LR_RXBYTEADDR)
+            return; // read-only
+    }
+
+    *reg(a) = v;
+}
+
+void SX127x_sim::write_opmode(uint8_t v)
+{
+    uint8_t old = common[REG_OPMODE];
+
+    /* LongRangeMode can only change in sleep */
+    if ((old & 7) != RF_OPMODE_SLEEP)
+        v = (v & ~OPMODE_LONGRANGE) | (old & OPMODE_LONGRANGE);
+
+    if (type == SX1272 && (v & OPMODE_LONGRANGE))
+        v &= ~0x38; // unused bits in sx1272 lora mode
+
+    common[REG_OPMODE] = v;
+
+    if ((v & 7) != (old & 7) || ((v ^ old) & OPMODE_LONGRANGE))
+        enter_mode(v & 7);
+}
+
+void SX127x_sim::enter_mode(uint8_t mode)
+{
+    /* leaving previous mode cancels everything in progress */
+    if (rx_pending && rx_header_done)
+        rx_pending = false;
+    tx_end = 0;
+    cad_end = 0;
+    hop_next = 0;
+    rx_timeout_at = 0;
+    fsk_tx_started = false;
+    fsk_tx_remaining = -1;
+    fsk_irq1 = 0;
+    fsk_irq2 &= 0x17;   // PacketSent only lasts while transmitting
+    if (mode == RF_OPMODE_SLEEP) {
+        fsk_count = 0;
+        fsk_irq2 &= ~0x06;
+    }
+    if (!fsk_tx_bytes.empty()) {
+        tx_frames.push_back(fsk_tx_bytes);
+        fsk_tx_bytes.clear();
+    }
+
+    if (lora()) {
+        switch (mode) {
+            case RF_OPMODE_TRANSMITTER: {
+                uint8_t len = lora_page[REG_LR_PAYLOADLENGTH];
+                uint8_t base = lora_page[REG_LR_FIFOTXBASEADDR];
+                std::vector<uint8_t> frame;
+                for (unsigned i = 0; i < len; i++)
+                    frame.push_back(lora_fifo[(uint8_t)(base + i)]);
+                tx_frames.push_back(frame);
+                tx_end = now + lora_airtime_us(len);
+                if (tx_end == 0)
+                    tx_end = 1;
+                if (lora_page[REG_LR_HOPPERIOD]) {
+                    lora_page[REG_LR_HOPCHANNEL] &= ~0x3f;
+                    hop_log.push_back((common[REG_FRFMSB] << 16) | (common[REG_FRFMID] << 8) | common[REG_FRFLSB]);
+                    hop_next = now + lora_page[REG_LR_HOPPERIOD] * lora_symbol_us();
+                    set_irq(0x02);  // first FhssChangeChannel: request channel of next hop
+                }
+                } break;
+            case RF_OPMODE_SLEEP:
+            case RF_OPMODE_RECEIVER:
+            case RF_OPMODE_RECEIVER_SINGLE:
+                /* header and packet counters restart with each transition into RX */
+                lora_page[REG_LR_RXHEADERCNTVALUE_MSB] = 0;
+                lora_page[REG_LR_RXHEADERCNTVALUE_LSB] = 0;
+                lora_page[REG_LR_RXPACKETCNTVALUE_MSB] = 0;
+                lora_page[REG_LR_RXPACKETCNTVALUE_LSB] = 0;
+                if (mode == RF_OPMODE_SLEEP)
+                    break;
+                rx_byte_ptr = lora_page[REG_LR_FIFORXBASEADDR];
+                lora_page[REG_LR_RXBYTEADDR] = rx_byte_ptr - 1;
+                if (mode == RF_OPMODE_RECEIVER_SINGLE) {
+                    uint16_t symbs = ((lora_page[REG_LR_MODEMCONFIG2] & 3) << 8) | lora_page[REG_LR_SYMBTIMEOUTLSB];
+                    rx_timeout_at = now + symbs * lora_symbol_us();
+                    if (rx_timeout_at == 0)
+                        rx_timeout_at = 1;
+                }
+                break;
+            case RF_OPMODE_CAD:
+                cad_end = now + 2 * lora_symbol_us();
+                if (cad_end == 0)
+                    cad_end = 1;
+                break;
+        }
+    } else {
+        if (mode != RF_OPMODE_RECEIVER)
+            fsk_rx_active = false;
+    }
+}
+
+void SX127x_sim::set_irq(uint8_t bits)
+{
+    lora_page[REG_LR_IRQFLAGS] |= bits & ~lora_page[REG_LR_IRQFLAGSMASK];
+}
+
+/*********************************************************************/
+
+uint32_t SX127x_sim::lora_symbol_us()
+{
+    uint8_t bw, sf = lora_page[REG_LR_MODEMCONFIG2] >> 4;
+
+    if (type == SX1276)
+        bw = lora_page[REG_LR_MODEMCONFIG] >> 4;
+    else
+        bw = 7 + (lora_page[REG_LR_MODEMCONFIG] >> 6);
+    if (bw > 9)
+        bw = 9;
+
+    return ::lora_symbol_us(sf, bw);
+}
+
+uint32_t SX127x_sim::lora_airtime_us(uint8_t len)
+{
+    uint8_t mc = lora_page[REG_LR_MODEMCONFIG];
+    uint8_t mc2 = lora_page[REG_LR_MODEMCONFIG2];
+    uint8_t bw, sf = mc2 >> 4;
+    uint16_t npre = (lora_page[REG_LR_PREAMBLEMSB] << 8) | lora_page[REG_LR_PREAMBLELSB];
+
+    if (type == SX1276) {
+        bw = mc >> 4;
+        if (bw > 9)
+            bw = 9;
+        return ::lora_airtime_us(sf, bw, (mc >> 1) & 7, npre, len, (mc2 >> 2) & 1, mc & 1,
+                                 (lora_page[REG_LR_MODEMCONFIG3] >> 3) & 1);
+    } else {
+        bw = 7 + (mc >> 6);
+        if (bw > 9)
+            bw = 9;
+        return ::lora_airtime_us(sf, bw, (mc >> 3) & 7, npre, len, (mc >> 1) & 1, (mc >> 2) & 1, mc & 1);
+    }
+}
+
+void SX127x_sim::lora_rx(const uint8_t* payload, uint8_t len, int rssi_dbm, int snr_db, bool crc_error)
+{
+    uint32_t sym = lora_symbol_us();
+    int npre = (lora_page[REG_LR_PREAMBLEMSB] << 8) | lora_page[REG_LR_PREAMBLELSB];
+
+    rx_payload.assign(payload, payload + len);
+    rx_rssi = rssi_dbm;
+    rx_snr = snr_db;
+    rx_crc_error = crc_error;
+    rx_start = now;
+    rx_header_at = now + ((npre * 4 + 17 + 8 * 4) * sym) / 4;
+    rx_end = now + lora_airtime_us(len);
+    rx_header_done = false;
+    rx_written = 0;
+    rx_pending = true;
+}
+
+void SX127x_sim::lora_advance()
+{
+    uint8_t mode = common[REG_OPMODE] & 7;
+    bool receiving = mode == RF_OPMODE_RECEIVER || mode == RF_OPMODE_RECEIVER_SINGLE;
+
+    /* FHSS: new channel taken from RegFrf at each hop period boundary */
+    while (hop_next && tx_end && due(hop_next) && !due(tx_end)) {
+        if (lora_page[REG_LR_IRQFLAGS] & 0x02)
+            hop_missed++;
+        hop_log.push_back((common[REG_FRFMSB] << 16) | (common[REG_FRFMID] << 8) | common[REG_FRFLSB]);
+        lora_page[REG_LR_HOPCHANNEL] = (lora_page[REG_LR_HOPCHANNEL] & ~0x3f) | ((lora_page[REG_LR_HOPCHANNEL] + 1) & 0x3f);
+        set_irq(0x02);  // FhssChangeChannel
+        hop_next += lora_page[REG_LR_HOPPERIOD] * lora_symbol_us();
+    }
+
+    if (tx_end && due(tx_end)) {
+        tx_end = 0;
+        set_irq(0x08);  // TxDone
+        common[REG_OPMODE] = (common[REG_OPMODE] & ~7) | RF_OPMODE_STANDBY;
+    }
+
+    if (cad_end && due(cad_end)) {
+        cad_end = 0;
+        set_irq(0x04);  // CadDone
+        if (cad_busy || (rx_pending && !due(rx_end)))
+            set_irq(0x01);  // CadDetected
+        common[REG_OPMODE] = (common[REG_OPMODE] & ~7) | RF_OPMODE_STANDBY;
+    }
+
+    if (rx_pending) {
+        if (!receiving && rx_header_done) {
+            rx_pending = false; // receiver turned off during packet
+        } else if (!rx_header_done && due(rx_header_at)) {
+            if (!receiving) {
+                rx_pending = false;
+            } else {
+                RegModemConfig_t mc;
+                mc.octet = lora_page[REG_LR_MODEMCONFIG];
+                rx_header_done = true;
+                rx_start_addr = rx_byte_ptr;
+                rx_timeout_at = 0;
+                if (!(type == SX1276 ? mc.sx1276bits.ImplicitHeaderModeOn : mc.sx1272bits.ImplicitHeaderModeOn)) {
+                    uint16_t cnt = (lora_page[REG_LR_RXHEADERCNTVALUE_MSB] << 8) | lora_page[REG_LR_RXHEADERCNTVALUE_LSB];
+                    cnt++;
+                    lora_page[REG_LR_RXHEADERCNTVALUE_MSB] = cnt >> 8;
+                    lora_page[REG_LR_RXHEADERCNTVALUE_LSB] = cnt;
+                    lora_page[REG_LR_RXNBBYTES] = rx_payload.size();
+                    RegHopChannel_t hc;
+                    hc.octet = lora_page[REG_LR_HOPCHANNEL];
+                    hc.bits.RxPayloadCrcOn = type == SX1276 ? (lora_page[REG_LR_MODEMCONFIG2] >> 2) & 1 : (mc.octet >> 1) & 1;
+                    lora_page[REG_LR_HOPCHANNEL] = hc.octet;
+                    set_irq(0x10);  // ValidHeader
+                }
+                RegModemStatus_t ms;
+                ms.octet = 0x0b;    // detect, header_valid, sync
+                ms.bits.RxCodingRate = type == SX1276 ? mc.sx1276bits.CodingRate : mc.sx1272bits.CodingRate;
+                lora_page[REG_LR_MODEMSTAT] = ms.octet;
+            }
+        }
+
+        if (rx_pending && rx_header_done) {
+            /* payload bytes land in fifo linearly over payload airtime */
+            unsigned due_bytes = rx_payload.size();
+            if (!due(rx_end))
+                due_bytes = (uint64_t)rx_payload.size() * (now - rx_header_at) / (rx_end - rx_header_at);
+            while (rx_written < due_bytes) {
+                lora_fifo[rx_byte_ptr] = rx_payload[rx_written++];
+                lora_page[REG_LR_RXBYTEADDR] = rx_byte_ptr++;
+            }
+        }
+
+        if (rx_pending && rx_header_done && due(rx_end)) {
+            RegModemConfig_t mc;
+            RegModemConfig2_t mc2;
+            RegHopChannel_t hc;
+            uint16_t cnt;
+            bool crc_on;
+
+            mc.octet = lora_page[REG_LR_MODEMCONFIG];
+            mc2.octet = lora_page[REG_LR_MODEMCONFIG2];
+            crc_on = type == SX1276 ? mc2.sx1276bits.RxPayloadCrcOn : mc.sx1272bits.RxPayloadCrcOn;
+
+            rx_pending = false;
+            lora_page[REG_LR_FIFORXCURRENTADDR] = rx_start_addr;
+            lora_page[REG_LR_RXNBBYTES] = rx_payload.size();
+            lora_page[REG_LR_PKTSNRVALUE] = (uint8_t)(int8_t)(rx_snr * 4);
+            if (type == SX1276) {
+                uint32_t frf = (common[REG_FRFMSB] << 16) | (common[REG_FRFMID] << 8) | common[REG_FRFLSB];
+                lora_page[REG_LR_PKTRSSIVALUE] = rx_rssi + (frf < 0x8340000 / 16 ? 164 : 157);
+            } else
+                lora_page[REG_LR_PKTRSSIVALUE] = rx_rssi + 139;
+            hc.octet = lora_page[REG_LR_HOPCHANNEL];
+            hc.bits.RxPayloadCrcOn = crc_on;
+            lora_page[REG_LR_HOPCHANNEL] = hc.octet;
+            cnt = (lora_page[REG_LR_RXPACKETCNTVALUE_MSB] << 8) | lora_page[REG_LR_RXPACKETCNTVALUE_LSB];
+            cnt++;
+            lora_page[REG_LR_RXPACKETCNTVALUE_MSB] = cnt >> 8;
+            lora_page[REG_LR_RXPACKETCNTVALUE_LSB] = cnt;
+            lora_page[REG_LR_MODEMSTAT] &= ~0x0f;
+
+            set_irq(rx_crc_error ? 0x60 : 0x40);   // RxDone (+PayloadCrcError)
+            if (mode == RF_OPMODE_RECEIVER_SINGLE)
+                common[REG_OPMODE] = (common[REG_OPMODE] & ~7) | RF_OPMODE_STANDBY;
+        }
+    }
+
+    if (rx_timeout_at && due(rx_timeout_at)) {
+        rx_timeout_at = 0;
+        if (rx_pending && !rx_header_done && (int32_t)(now - rx_start) > 0) {
+            /* preamble detected within window: receiver stays on for the packet */
+        } else if (mode == RF_OPMODE_RECEIVER_SINGLE) {
+            set_irq(0x80);  // RxTimeout
+            common[REG_OPMODE] = (common[REG_OPMODE] & ~7) | RF_OPMODE_STANDBY;
+        }
+    }
+}
+
+/*********************************************************************/
+
+uint32_t SX127x_sim::fsk_byte_us()
+{
+    uint16_t br = (fsk_page_regs[REG_FSK_BITRATEMSB] << 8) | fsk_page_regs[REG_FSK_BITRATELSB];
+    if (br == 0)
+        br = 1;
+    /* 8 bits at XTAL_FREQ / br */
+    return (8ULL * br * 1000000 + XTAL_FREQ - 1) / XTAL_FREQ;
+}
+
+uint32_t SX127x_sim::fsk_leadin_us()
+{
+    RegSyncConfig_t sc;
+    uint16_t pre = (fsk_page_regs[REG_FSK_PREAMBLEMSB] << 8) | fsk_page_regs[REG_FSK_PREAMBLELSB];
+    sc.octet = fsk_page_regs[REG_FSK_SYNCCONFIG];
+    return (pre + (sc.bits.SyncOn ? sc.bits.SyncSize + 1 : 0)) * fsk_byte_us();
+}
+
+uint8_t SX127x_sim::fsk_pop()
+{
+    uint8_t b;
+
+    if (fsk_count == 0)
+        return 0;
+    b = fsk_fifo[fsk_head];
+    fsk_head = (fsk_head + 1) % sizeof(fsk_fifo);
+    if (--fsk_count == 0)
+        fsk_irq2 &= ~0x06;  // PayloadReady, CrcOk cleared when fifo empty
+    return b;
+}
+
+void SX127x_sim::fsk_push(uint8_t b)
+{
+    if (fsk_count == sizeof(fsk_fifo)) {
+        fsk_irq2 |= 0x10;   // FifoOverrun
+        return;
+    }
+    fsk_fifo[(fsk_head + fsk_count) % sizeof(fsk_fifo)] = b;
+    fsk_count++;
+}
+
+void SX127x_sim::fsk_rx(const uint8_t* payload, uint16_t len, bool crc_ok)
+{
+    RegPktConfig1_t pc1;
+    pc1.octet = fsk_page_regs[REG_FSK_PACKETCONFIG1];
+
+    fsk_rx_bytes.clear();
+    if (pc1.bits.PacketFormatVariable)
+        fsk_rx_bytes.push_back(len);
+    fsk_rx_bytes.insert(fsk_rx_bytes.end(), payload, payload + len);
+    fsk_rx_pos = 0;
+    fsk_rx_crc_ok = crc_ok;
+    fsk_rx_next = now + fsk_leadin_us();
+    fsk_rx_active = true;
+}
+
+void SX127x_sim::fsk_advance()
+{
+    uint8_t mode = common[REG_OPMODE] & 7;
+    RegPktConfig1_t pc1;
+    RegFifoThreshold_t th;
+
+    pc1.octet = fsk_page_regs[REG_FSK_PACKETCONFIG1];
+    th.octet = fsk_page_regs[REG_FSK_FIFOTHRESH];
+
+    if (mode == RF_OPMODE_TRANSMITTER && !(fsk_irq2 & 0x08)) {
+        if (!fsk_tx_started) {
+            bool start = th.bits.TxStartCondition ? fsk_count > 0 : fsk_count > th.bits.FifoThreshold;
+            if (start) {
+                fsk_tx_started = true;
+                fsk_tx_next = now + fsk_leadin_us();
+                fsk_tx_remaining = -1;
+                if (!pc1.bits.PacketFormatVariable)
+                    fsk_tx_remaining = ((fsk_page_regs[REG_FSK_PACKETCONFIG2] & 7) << 8) | fsk_page_regs[REG_FSK_PAYLOADLENGTH];
+            }
+        }
+        while (fsk_tx_started && due(fsk_tx_next)) {
+            if (fsk_tx_remaining == FSK_TX_DONE) {
+                fsk_irq2 |= 0x08;   // PacketSent
+                fsk_tx_started = false;
+                break;
+            }
+            if (fsk_count == 0) {
+                if (!fsk_tx_starved && fsk_tx_remaining != -1)
+                    fsk_tx_underrun++;
+                fsk_tx_starved = true;
+                break;  // underrun: wait for host
+            }
+            fsk_tx_starved = false;
+            if (fsk_tx_remaining == -1) {
+                fsk_tx_remaining = fsk_pop();
+            } else {
+                fsk_tx_bytes.push_back(fsk_pop());
+                fsk_tx_remaining--;
+            }
+            fsk_tx_next += fsk_byte_us();
+            if (fsk_tx_remaining == 0) {
+                fsk_tx_remaining = FSK_TX_DONE;
+                if (pc1.bits.CrcOn)
+                    fsk_tx_next += 2 * fsk_byte_us();
+            }
+        }
+    }
+
+    if (fsk_rx_active) {
+        if (mode != RF_OPMODE_RECEIVER) {
+            fsk_rx_active = false;
+        } else {
+            while (due(fsk_rx_next) && fsk_rx_pos < fsk_rx_bytes.size()) {
+                fsk_irq1 |= 0x03;   // PreambleDetect, SyncAddressMatch
+                fsk_push(fsk_rx_bytes[fsk_rx_pos++]);
+                fsk_rx_next += fsk_byte_us();
+            }
+            if (fsk_rx_pos == fsk_rx_bytes.size() && due(fsk_rx_next)) {
+                fsk_rx_active = false;
+                if (pc1.bits.CrcOn && !fsk_rx_crc_ok && !pc1.bits.CrcAutoClearOff) {
+                    fsk_count = 0;  // fifo cleared, no PayloadReady
+                } else {
+                    fsk_irq2 |= 0x04;   // PayloadReady
+                    if (fsk_rx_crc_ok)
+                        fsk_irq2 |= 0x02;   // CrcOk
+                }
+            }
+        }
+    }
+
+    if (seq_state != SEQ_OFF)
+        seq_advance();
+}
+
+uint32_t SX127x_sim::seq_timer_us(uint8_t n)
+{
+    static const uint32_t res_us[4] = { 0, 64, 4100, 262000 };
+    uint8_t tr = fsk_page_regs[REG_FSK_TIMERRESOL];
+    uint8_t res = n == 1 ? (tr >> 2) & 3 : tr & 3;
+    return res_us[res] * fsk_page_regs[n == 1 ? REG_FSK_TIMER1COEF : REG_FSK_TIMER2COEF];
+}
+
+void SX127x_sim::seq_enter(uint8_t state)
+{
+    RegSeqConfig1_t c1;
+    uint32_t t;
+
+    c1.octet = fsk_page_regs[REG_FSK_SEQCONFIG1];
+    seq_timer_end = 0;
+
+    if (state == SEQ_LOWPOWER && !c1.bits.LowPowerSelection) {
+        seq_state = SEQ_OFF;
+        write_opmode((common[REG_OPMODE] & ~7) | seq_init_mode);
+        return;
+    }
+
+    seq_state = state;
+    switch (state) {
+        case SEQ_LOWPOWER:  // idle
+            write_opmode((common[REG_OPMODE] & ~7) | (c1.bits.IdleMode ? RF_OPMODE_SLEEP : RF_OPMODE_STANDBY));
+            t = seq_timer_us(1);
+            break;
+        case SEQ_TX:
+            write_opmode((common[REG_OPMODE] & ~7) | RF_OPMODE_TRANSMITTER);
+            t = 0;
+            break;
+        default:    // SEQ_RX
+            write_opmode((common[REG_OPMODE] & ~7) | RF_OPMODE_RECEIVER);
+            t = seq_timer_us(2);
+            break;
+    }
+    if (t) {
+        seq_timer_end = now + t;
+        if (seq_timer_end == 0)
+            seq_timer_end = 1;
+    }
+}
+
+void SX127x_sim::seq_advance()
+{
+    RegSeqConfig1_t c1;
+    RegSeqConfig2_t c2;
+
+    c1.octet = fsk_page_regs[REG_FSK_SEQCONFIG1];
+    c2.octet = fsk_page_regs[REG_FSK_SEQCONFIG2];
+
+    switch (seq_state) {
+        case SEQ_LOWPOWER:
+            if (seq_timer_end && due(seq_timer_end))
+                seq_enter(c1.bits.FromIdle ? SEQ_RX : SEQ_TX);
+            break;
+        case SEQ_TX:
+            if (fsk_irq2 & 0x08)    // PacketSent
+                seq_enter(c1.bits.FromTransmit ? SEQ_RX : SEQ_LOWPOWER);
+            break;
+        case SEQ_RX:
+            if (fsk_irq2 & 0x04) {  // PayloadReady
+                bool received = c2.bits.FromReceive == 1 || (c2.bits.FromReceive == 3 && (fsk_irq2 & 0x02));
+                if (c2.bits.FromReceive == 2)
+                    seq_enter(SEQ_LOWPOWER);
+                else if (!received)
+                    seq_state = SEQ_OFF;
+                else switch (c2.bits.FromPacketReceived) {
+                    case 0: seq_state = SEQ_OFF; break;
+                    case 1: seq_enter(SEQ_TX); break;
+                    case 2: seq_enter(SEQ_LOWPOWER); break;
+                    default: seq_enter(SEQ_RX); break;
+                }
+            } else if (seq_timer_end && due(seq_timer_end) && !(fsk_irq1 & 0x02)) {
+                /* RxTimeout, unless sync already matched */
+                switch (c2.bits.FromRxTimeout) {
+                    case 0: seq_enter(SEQ_RX); break;
+                    case 1: seq_enter(SEQ_TX); break;
+                    case 2: seq_enter(SEQ_LOWPOWER); break;
+                    default: seq_state = SEQ_OFF; break;
+                }
+            }
+            break;
+    }
+}
+
+/*********************************************************************/
+
+void SX127x_sim::advance(uint32_t now_us)
+{
+    now = now_us;
+
+    if (lora())
+        lora_advance();
+    else
+        fsk_advance();
+}
+
+int SX127x_sim::dio(uint8_t n)
+{
+    RegDioMapping1_t m;
+    uint8_t mode = common[REG_OPMODE] & 7;
+    unsigned map;
+
+    m.octet = common[REG_DIOMAPPING1];
+    switch (n) {
+        case 0: map = m.bits.Dio0Mapping; break;
+        case 1: map = m.bits.Dio1Mapping; break;
+        case 2: map = m.bits.Dio2Mapping; break;
+        case 3: map = m.bits.Dio3Mapping; break;
+        default: return 0;
+    }
+
+    if (lora()) {
+        RegIrqFlags_t f;
+        f.octet = lora_page[REG_LR_IRQFLAGS];
+        switch (n) {
+            case 0:
+                if (map == 0) return f.bits.RxDone;
+                if (map == 1) return f.bits.TxDone;
+                if (map == 2) return f.bits.CadDone;
+                return 0;
+            case 1:
+                if (map == 0) return f.bits.RxTimeout;
+                if (map == 1) return f.bits.FhssChangeChannel;
+                if (map == 2) return f.bits.CadDetected;
+                return 0;
+            case 2:
+                return map < 3 ? f.bits.FhssChangeChannel : 0;
+            case 3:
+                if (map == 0) return f.bits.CadDone;
+                if (map == 1) return f.bits.ValidHeader;
+                if (map == 2) return f.bits.PayloadCrcError;
+                return 0;
+        }
+    } else {
+        RegIrqFlags1_t f1;
+        RegIrqFlags2_t f2;
+        f1.octet = read(REG_FSK_IRQFLAGS1);
+        f2.octet = read(REG_FSK_IRQFLAGS2);
+        switch (n) {
+            case 0:
+                if (map == 0) return mode == RF_OPMODE_TRANSMITTER ? f2.bits.PacketSent : f2.bits.PayloadReady;
+                if (map == 1) return mode == RF_OPMODE_TRANSMITTER ? 0 : f2.bits.CrcOk;
+                return 0;
+            case 1:
+                if (map == 0) return f2.bits.FifoLevel;
+                if (map == 1) return f2.bits.FifoEmpty;
+                if (map == 2) return f2.bits.FifoFull;
+                return 0;
+            case 2:
+                if (map < 3) return f2.bits.FifoFull;
+                return mode == RF_OPMODE_RECEIVER ? f1.bits.SyncAddressMatch : 0;
+            case 3:
+                if (map == 0) return f2.bits.FifoEmpty;
+                if (map == 1) return f1.bits.TxReady;
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
+#endif /* SX127X_HOST */
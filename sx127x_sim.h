@@ -0,0 +1,156 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_SIM_H
+#define SX127x_SIM_H
+
+#ifdef SX127X_HOST
+
+#include "sx127x.h"
+
+/** register-level model of SX1272/SX1276, served over SX127x_host_hal.
+ * Models: LoRa/FSK register pages, opmode transitions, 256 byte LoRa FIFO with
+ * FifoAddrPtr/RxBase/TxBase, write-1-to-clear IRQ flags, 64 byte FSK FIFO, and
+ * DIO0..DIO3 driven by simulated airtime, LoRa FHSS on transmit, FSK top level sequencer
+ * with Timer1/Timer2.
+ * Packets arrive over the air with lora_rx() / fsk_rx(); transmitted packets land in tx_frames.
+ */
+class SX127x_sim : public SX127x_spi_device {
+    public:
+        SX127x_sim(type_e t);
+
+        void select(bool sel);
+        uint8_t transfer(uint8_t mosi);
+        int dio(uint8_t n);
+        void reset(void);
+        void advance(uint32_t now_us);
+
+        /** start LoRa packet on air now, received if radio is in RX mode when preamble completes
+         * @param payload packet contents
+         * @param len payload length
+         * @param rssi_dbm packet strength
+         * @param snr_db packet signal to noise
+         * @param crc_error set PayloadCrcError at RxDone
+         */
+        void lora_rx(const uint8_t* payload, uint8_t len, int rssi_dbm, int snr_db, bool crc_error = false);
+
+        /** start FSK packet on air now, bytes enter the FIFO at the programmed bitrate
+         * @param payload packet contents (without length byte)
+         * @param len payload length
+         * @param crc_ok CrcOk reported at PayloadReady
+         */
+        void fsk_rx(const uint8_t* payload, uint16_t len, bool crc_ok = true);
+
+        /** LoRa time on air with current modem configuration */
+        uint32_t lora_airtime_us(uint8_t len);
+        uint32_t lora_symbol_us(void);
+
+        /** register value on current page, no side effects */
+        uint8_t peek(uint8_t addr);
+
+        //! CAD reports activity when set, or when a LoRa packet is on air
+        bool cad_busy;
+
+        //! FHSS: RegFrf in use for each hop period of transmitted packets
+        std::vector<uint32_t> hop_log;
+        //! FHSS: hops where FhssChangeChannel was still set at the next boundary
+        unsigned hop_missed;
+
+        //! FSK transmitter found FIFO empty mid-packet (real radio would send garbage)
+        unsigned fsk_tx_underrun;
+
+        //! payloads transmitted
+        std::vector< std::vector<uint8_t> > tx_frames;
+
+        //! SPI traffic served
+        unsigned transactions;
+        unsigned bytes;
+
+        type_e type;
+        uint8_t lora_fifo[256];
+
+    private:
+        bool lora(void) const;
+        bool fsk_page(void) const;
+        uint8_t* reg(uint8_t addr);
+        uint8_t read(uint8_t addr);
+        void write(uint8_t addr, uint8_t v);
+        void write_opmode(uint8_t v);
+        void enter_mode(uint8_t mode);
+        void set_irq(uint8_t bits);
+        uint8_t fsk_pop(void);
+        void fsk_push(uint8_t b);
+        uint32_t fsk_byte_us(void);
+        uint32_t fsk_leadin_us(void);
+        void lora_advance(void);
+        void fsk_advance(void);
+        void seq_enter(uint8_t state);
+        void seq_advance(void);
+        uint32_t seq_timer_us(uint8_t n);
+        bool due(uint32_t t) const { return (int32_t)(now - t) >= 0; }
+
+        uint8_t common[0x80];   // 0x00->0x0c and 0x40->0x7f
+        uint8_t lora_page[0x40];
+        uint8_t fsk_page_regs[0x40];
+
+        bool first;
+        bool wr;
+        uint8_t addr;
+        uint32_t now;
+
+        /* lora receiver */
+        bool rx_pending;
+        std::vector<uint8_t> rx_payload;
+        int rx_rssi, rx_snr;
+        bool rx_crc_error;
+        uint32_t rx_start, rx_header_at, rx_end;
+        bool rx_header_done;
+        uint8_t rx_written;
+        uint8_t rx_start_addr;
+        uint32_t rx_timeout_at;
+        uint8_t rx_byte_ptr;
+
+        /* lora transmitter / cad */
+        uint32_t tx_end;
+        uint32_t cad_end;
+        uint32_t hop_next;
+
+        /* fsk */
+        uint8_t fsk_fifo[64];
+        uint8_t fsk_head, fsk_count;
+        int fsk_tx_remaining;   // -1: length byte not yet sent
+        bool fsk_tx_started;
+        bool fsk_tx_starved;
+        uint32_t fsk_tx_next;
+        std::vector<uint8_t> fsk_tx_bytes;
+        std::vector<uint8_t> fsk_rx_bytes;
+        uint16_t fsk_rx_pos;
+        uint32_t fsk_rx_next;
+        bool fsk_rx_crc_ok;
+        bool fsk_rx_active;
+        uint8_t fsk_irq1;       // sticky bits of 0x3e
+        uint8_t fsk_irq2;       // sticky bits of 0x3f
+
+        /* fsk sequencer */
+        uint8_t seq_state;
+        uint8_t seq_init_mode;  // chip mode at SequencerStart
+        uint32_t seq_timer_end; // 0: no timer running
+        uint16_t rng;
+};
+
+#endif /* SX127X_HOST */
+
+#endif /* SX127x_SIM_H */
@@ -0,0 +1,36 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SX127x_TEST_H
+#define SX127x_TEST_H
+
+/* minimal host test support: CHECK() reports and counts failures, main returns TEST_RESULT() */
+
+#include <stdio.h>
+
+static unsigned test_failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { test_failures++; printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { unsigned long a_ = (unsigned long)(a), b_ = (unsigned long)(b); \
+         if (a_ != b_) { test_failures++; printf("%s:%d: %s == 0x%lx, expected 0x%lx\n", __FILE__, __LINE__, #a, a_, b_); } } while (0)
+
+#define TEST_RESULT(name) \
+    (printf("%s: %s\n", name, test_failures ? "FAIL" : "ok"), test_failures ? 1 : 0)
+
+#endif /* SX127x_TEST_H */
@@ -0,0 +1,172 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* fixed-point frequency/bitrate/bandwidth math: register bytes must be bit-exact.
+ * References are exact integer forms of the datasheet formulas; the float code they
+ * replaced rounded FRF above 500MHz, so it is not itself a usable reference there. */
+
+#include "sx127x_fsk.h"
+#include "sx127x_lora.h"
+#include "sx127x_sim.h"
+#include "test.h"
+
+static uint32_t frf_ref(uint32_t hz)
+{
+    return (uint32_t)(((uint64_t)hz << 19) / XTAL_FREQ);
+}
+
+static uint32_t frf_regs(SX127x_sim& sim)
+{
+    return (sim.peek(REG_FRFMSB) << 16) | (sim.peek(REG_FRFMID) << 8) | sim.peek(REG_FRFLSB);
+}
+
+static void test_frf_sweep()
+{
+    uint32_t hz, frf;
+
+    for (hz = 137000000; hz <= 1020000000; hz += 999983) {
+        CHECK_EQ(sx127x_hz_to_frf(hz), frf_ref(hz));
+        frf = frf_ref(hz);
+        CHECK_EQ(sx127x_frf_to_hz(frf), ((uint64_t)frf * XTAL_FREQ) >> 19);
+    }
+    /* full 32 bit range used by Fdev and offsets */
+    CHECK_EQ(sx127x_hz_to_frf(0xffffffff), frf_ref(0xffffffff));
+}
+
+static void test_frf_registers()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_mock_hal hal(sim);
+    SX127x radio(hal);
+
+    hal.clear();
+    radio.set_frf_hz(915000000);
+    CHECK_EQ(frf_regs(sim), 0xe4c000);
+    CHECK_EQ(hal.writes_to(REG_FRFMSB), 1);    // one burst for all three bytes
+    CHECK_EQ(radio.get_frf_hz(), 915000000);
+
+    radio.set_frf_hz(868100000);
+    CHECK_EQ(frf_regs(sim), 0xd90666);
+    CHECK_EQ(radio.get_frf_hz(), 868099975);   // 0xd90666 steps, truncated
+
+    /* float API rounds to Hz, then takes the same integer path */
+    radio.set_frf_MHz(868.0f);
+    CHECK_EQ(frf_regs(sim), 0xd90000);
+    radio.set_frf_MHz(433.5f);
+    CHECK_EQ(frf_regs(sim), frf_ref(433500000));
+
+    radio.set_frf_hz(433000000);
+    CHECK_EQ(frf_regs(sim), 0x6c4000);
+    radio.get_frf_hz();
+    CHECK(!radio.HF);
+
+    /* sx1276 band 1 (HF port) starts exactly at 525MHz */
+    radio.set_frf_hz(525000000);
+    CHECK_EQ(frf_regs(sim), FRF_HF_MIN);
+    radio.get_frf_hz();
+    CHECK(radio.HF);
+
+    radio.set_frf_hz(524999999);
+    CHECK_EQ(frf_regs(sim), FRF_HF_MIN - 1);
+    radio.get_frf_hz();
+    CHECK(!radio.HF);
+}
+
+static void test_fsk_registers()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+
+    fsk.enable(false);
+
+    fsk.set_bitrate(4800);
+    CHECK_EQ((sim.peek(REG_FSK_BITRATEMSB) << 8) | sim.peek(REG_FSK_BITRATELSB), 0x1a0a);
+    CHECK_EQ(fsk.get_bitrate(), 4800);
+    fsk.set_bitrate(250000);
+    CHECK_EQ((sim.peek(REG_FSK_BITRATEMSB) << 8) | sim.peek(REG_FSK_BITRATELSB), 0x0080);
+
+    fsk.set_tx_fdev_hz(5050);
+    CHECK_EQ((sim.peek(REG_FSK_FDEVMSB) << 8) | sim.peek(REG_FSK_FDEVLSB), 0x0052);
+    fsk.set_tx_fdev_hz(25000);
+    CHECK_EQ((sim.peek(REG_FSK_FDEVMSB) << 8) | sim.peek(REG_FSK_FDEVLSB), 0x0199);
+    CHECK_EQ(fsk.get_tx_fdev_hz(), 24963);
+
+    /* RxBw: mantissa field bits 3-4 (16, 20, 24), exponent bits 0-2 */
+    fsk.set_rx_dcc_bw_hz(10500, 0);
+    CHECK_EQ(sim.peek(REG_FSK_RXBW) & 0x1f, 0x15);     // 24, 5: 10416Hz
+    fsk.set_rx_dcc_bw_hz(50000, 1);
+    CHECK_EQ(sim.peek(REG_FSK_AFCBW) & 0x1f, 0x0b);    // 20, 3: 50000Hz
+    CHECK_EQ(fsk.get_rx_bw_hz(REG_FSK_RXBW), 10416);
+    CHECK_EQ(fsk.get_rx_bw_hz(REG_FSK_AFCBW), 50000);
+    fsk.set_rx_afc_bw_hz(500000, 1000);
+    CHECK_EQ(sim.peek(REG_FSK_RXBW) & 0x1f, 0x00);     // 16, 0: widest
+    CHECK_EQ(sim.peek(REG_FSK_AFCBW) & 0x1f, 0x17);    // 24, 7: narrowest
+    CHECK_EQ(fsk.get_rx_bw_hz(REG_FSK_RXBW), 500000);
+    CHECK_EQ(fsk.get_rx_bw_hz(REG_FSK_AFCBW), 2604);
+}
+
+static void test_lora_math()
+{
+    int32_t fei;
+    uint8_t bw;
+
+    CHECK_EQ(lora_symbol_us(7, 7), 1024);      // SF7 125KHz
+    CHECK_EQ(lora_symbol_us(12, 7), 32768);
+    CHECK_EQ(lora_symbol_us(12, 0), 524288);   // SF12 7.8KHz
+    CHECK_EQ(lora_bw_hz(0), 7812);
+    CHECK_EQ(lora_bw_hz(9), 500000);
+
+    /* fei * 2^24 / XTAL_FREQ * bw / 500KHz, truncated toward zero */
+    for (bw = 0; bw <= 9; bw++) {
+        for (fei = -524288; fei < 524288; fei += 4099) {
+            int64_t ref = (int64_t)fei * (1 << 24) / ((int64_t)XTAL_FREQ * lora_bw_div(bw));
+            CHECK_EQ((int64_t)lora_fei_to_hz(fei, bw), ref);
+        }
+    }
+}
+
+/* table entries agree with the formula, and with a hand-worked case */
+static void test_airtime_table()
+{
+    uint8_t sf, bw, cr;
+    int len;
+
+    for (sf = 6; sf <= 12; sf++) {
+        for (bw = 0; bw <= 9; bw++) {
+            for (cr = 1; cr <= 4; cr++) {
+                for (len = 0; len <= 255; len += 51) {
+                    CHECK_EQ(lora_airtime_lookup(sf, bw, cr).us(len),
+                             lora_airtime_us(sf, bw, cr, 8, len, true, false, lora_ldro_needed(sf, bw)));
+                }
+            }
+        }
+    }
+    /* SF7 125KHz 4/5, 20 bytes: 12.25 + 8 + 7 * 5 symbols of 1024us */
+    CHECK_EQ(lora_airtime_lookup(7, 7, 1).us(20), 56576);
+}
+
+int main()
+{
+    test_frf_sweep();
+    test_frf_registers();
+    test_fsk_registers();
+    test_lora_math();
+    test_airtime_table();
+    return TEST_RESULT("test_fixed");
+}
@@ -0,0 +1,468 @@
+/* SX127x driver
+ * Copyright (c) 2013 Semtech
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* driver against the register-level simulator: LoRa and FSK TX/RX, FSK streaming,
+ * each polled and with DIO interrupts */
+
+#include "sx127x_fsk.h"
+#include "sx127x_lora.h"
+#include "sx127x_sim.h"
+#include "test.h"
+
+#define LOOP_LIMIT  100000  // service() calls before a test gives up
+
+static void test_lora_tx(bool irq)
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_lora lora(radio);
+    uint8_t payload[40];
+    uint32_t t0;
+    int i;
+
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = i * 5 + 1;
+    if (irq)
+        radio.enable_dio_irq();
+    lora.setSf(7);
+    lora.setBw(7);
+    radio.set_opmode(RF_OPMODE_STANDBY);
+
+    t0 = hal.now_us();
+    lora.start_tx(payload, sizeof(payload));
+    for (i = 0; i < LOOP_LIMIT && lora.service() != SERVICE_TX_DONE; i++)
+        hal.wait_us(100);
+
+    CHECK(i < LOOP_LIMIT);
+    CHECK_EQ(sim.tx_frames.size(), 1);
+    if (sim.tx_frames.size() == 1) {
+        CHECK_EQ(sim.tx_frames[0].size(), sizeof(payload));
+        CHECK(memcmp(&sim.tx_frames[0][0], payload, sizeof(payload)) == 0);
+    }
+    CHECK_EQ(lora.RegPayloadLength, sizeof(payload));
+    /* driver and model agree on time on air, TxDone seen within one poll of it */
+    CHECK_EQ(lora.get_airtime_us(sizeof(payload)), sim.lora_airtime_us(sizeof(payload)));
+    CHECK(hal.now_us() - t0 >= sim.lora_airtime_us(sizeof(payload)));
+    CHECK(hal.now_us() - t0 < sim.lora_airtime_us(sizeof(payload)) + 1000);
+    CHECK_EQ(radio.RegOpMode.bits.Mode, RF_OPMODE_STANDBY);
+}
+
+static void test_lora_rx(bool irq)
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_lora lora(radio);
+    uint8_t payload[20], rx[256];
+    service_action_e a = SERVICE_NONE;
+    int i, k;
+
+    if (irq)
+        radio.enable_dio_irq();
+    radio.rx_dest = rx;
+    lora.poll_vh = true;
+    lora.setSf(9);
+    lora.setBw(7);
+    lora.start_rx(RF_OPMODE_RECEIVER);
+
+    for (k = 0; k < 2; k++) {
+        bool crc_error = k == 1;
+        for (i = 0; i < (int)sizeof(payload); i++)
+            payload[i] = i + 0x40 * k;
+        memset(rx, 0, sizeof(rx));
+        sim.lora_rx(payload, sizeof(payload), -80, 7, crc_error);
+        for (i = 0; i < LOOP_LIMIT && (a = lora.service()) == SERVICE_NONE; i++)
+            hal.wait_us(500);
+
+        CHECK_EQ(a, SERVICE_READ_FIFO);
+        CHECK_EQ(lora.RegRxNbBytes, sizeof(payload));
+        CHECK_EQ(lora.rx_header.len, sizeof(payload));
+        CHECK(memcmp(rx, payload, sizeof(payload)) == 0);
+        CHECK_EQ(lora.RegIrqFlags.bits.PayloadCrcError, crc_error);
+        CHECK_EQ(lora.get_pkt_rssi(), -80);
+        CHECK_EQ(radio.RegOpMode.bits.Mode, RF_OPMODE_RECEIVER);   // continuous: still listening
+    }
+}
+
+/* get_random() turning the receiver on restarts the radio's packet counters */
+static void test_lora_stats_random()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_lora lora(radio);
+    SX127x_lora_stats st;
+    uint8_t payload[10], rx[256];
+    int i, k;
+
+    memset(payload, 0x77, sizeof(payload));
+    radio.rx_dest = rx;
+    lora.setSf(7);
+    lora.setBw(7);
+    lora.start_rx(RF_OPMODE_RECEIVER);
+
+    for (k = 0; k < 2; k++) {
+        sim.lora_rx(payload, sizeof(payload), -70, 5);
+        for (i = 0; i < LOOP_LIMIT && lora.service() != SERVICE_READ_FIFO; i++)
+            hal.wait_us(500);
+        CHECK(i < LOOP_LIMIT);
+
+        /* standby, random number, then straight back to RX */
+        radio.set_opmode(RF_OPMODE_STANDBY);
+        lora.get_random();
+        radio.set_opmode(RF_OPMODE_RECEIVER);
+    }
+
+    lora.get_stats(st, false);
+    CHECK_EQ(st.rx_ok, 2);
+    CHECK_EQ(st.rx_packets, 2);
+    CHECK_EQ(st.rx_headers, 2);
+}
+
+/* hopping: CAD senses the channel the packet starts on, its CadDetected edge is not a hop */
+static void test_lora_hop_cad(bool irq)
+{
+    static const uint8_t hops[][3] = {
+        SX127X_FRF_BYTES(902300000), SX127X_FRF_BYTES(902500000), SX127X_FRF_BYTES(902700000)
+    };
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_lora lora(radio);
+    uint8_t payload[16];
+    service_action_e a = SERVICE_NONE;
+    int i;
+
+    memset(payload, 0x5a, sizeof(payload));
+    if (irq)
+        radio.enable_dio_irq();
+    lora.setSf(7);
+    lora.setBw(7);
+    lora.set_hopping(hops, 3, 5);
+    radio.set_opmode(RF_OPMODE_STANDBY);
+
+    lora.start_tx(payload, sizeof(payload));
+    for (i = 0; i < LOOP_LIMIT && lora.service() != SERVICE_TX_DONE; i++)
+        hal.wait_us(100);
+    CHECK(i < LOOP_LIMIT);
+    CHECK(sim.peek(REG_FRFMSB + 2) != hops[0][2]);  // packet ended on a later channel
+
+    sim.cad_busy = true;
+    lora.start_tx_lbt(payload, sizeof(payload), 1);
+    for (i = 0; i < LOOP_LIMIT && (a = lora.service()) == SERVICE_NONE; i++)
+        hal.wait_us(100);
+
+    CHECK_EQ(a, SERVICE_CHANNEL_BUSY);
+    CHECK_EQ(sim.peek(REG_FRFMSB), hops[0][0]);
+    CHECK_EQ(sim.peek(REG_FRFMSB + 1), hops[0][1]);
+    CHECK_EQ(sim.peek(REG_FRFMSB + 2), hops[0][2]);
+    CHECK_EQ(sim.tx_frames.size(), 1);
+}
+
+/* with hopping DIO1 is FhssChangeChannel: the timeout is found in RegIrqFlags */
+static void test_lora_rx_timeout(bool hopping)
+{
+    static const uint8_t hops[][3] = {
+        SX127X_FRF_BYTES(902300000), SX127X_FRF_BYTES(902500000)
+    };
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_lora lora(radio);
+    service_action_e a = SERVICE_NONE;
+    uint32_t t0;
+    int i;
+
+    lora.setSf(7);
+    lora.setBw(7);
+    lora.set_symb_timeout(10);
+    if (hopping)
+        lora.set_hopping(hops, 2, 3);
+    t0 = hal.now_us();
+    lora.start_rx(RF_OPMODE_RECEIVER_SINGLE);
+    for (i = 0; i < LOOP_LIMIT && (a = lora.service()) == SERVICE_NONE; i++)
+        hal.wait_us(100);
+
+    CHECK_EQ(a, SERVICE_RX_TIMEOUT);
+    CHECK(hal.now_us() - t0 >= 10 * lora_symbol_us(7, 7));
+    CHECK(hal.now_us() - t0 < 11 * lora_symbol_us(7, 7));
+}
+
+/* duty-cycled receive: radio back to sleep as soon as the packet is out of the FIFO */
+static void test_lora_sniff()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_lora lora(radio);
+    uint8_t payload[12], rx[256];
+    service_action_e a = SERVICE_NONE;
+    int i;
+
+    memset(payload, 0x3c, sizeof(payload));
+    radio.rx_dest = rx;
+    lora.setSf(7);
+    lora.setBw(7);
+    lora.set_preamble(12);
+    lora.start_sniff(4);
+
+    hal.wait_us(5000);
+    sim.lora_rx(payload, sizeof(payload), -90, 3);
+    for (i = 0; i < LOOP_LIMIT && (a = lora.service()) == SERVICE_NONE; i++)
+        hal.wait_us(200);
+
+    CHECK_EQ(a, SERVICE_READ_FIFO);
+    CHECK(memcmp(rx, payload, sizeof(payload)) == 0);
+    CHECK_EQ(sim.peek(REG_OPMODE) & 7, RF_OPMODE_SLEEP);
+}
+
+static void fsk_setup(SX127x& radio, SX127x_fsk& fsk, bool irq, bool variable, uint16_t len)
+{
+    fsk.enable(false);
+    fsk.init();
+    fsk.set_bitrate(100000);
+    if (irq)
+        radio.enable_dio_irq();
+    fsk.RegPktConfig1.octet = radio.read_reg(REG_FSK_PACKETCONFIG1);
+    fsk.RegPktConfig1.bits.PacketFormatVariable = variable;
+    radio.write_reg(REG_FSK_PACKETCONFIG1, fsk.RegPktConfig1.octet);
+    if (!variable) {
+        fsk.RegPktConfig2.bits.PayloadLength = len;
+        radio.write_u16(REG_FSK_PACKETCONFIG2, fsk.RegPktConfig2.word);
+    }
+}
+
+/* fits the FIFO: loaded once before TX */
+static void test_fsk_tx(bool irq)
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    uint8_t payload[40];
+    int i;
+
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = i * 3 + 1;
+    fsk_setup(radio, fsk, irq, true, 0);
+
+    fsk.start_tx(payload, sizeof(payload));
+    for (i = 0; i < LOOP_LIMIT && fsk.service() != SERVICE_TX_DONE; i++)
+        hal.wait_us(100);
+
+    CHECK(i < LOOP_LIMIT);
+    CHECK_EQ(sim.tx_frames.size(), 1);
+    if (sim.tx_frames.size() == 1) {
+        CHECK_EQ(sim.tx_frames[0].size(), sizeof(payload));
+        CHECK(memcmp(&sim.tx_frames[0][0], payload, sizeof(payload)) == 0);
+    }
+}
+
+/* enable(true) takes bitrate from the radio: TX ends one bit period after PacketSent */
+static void test_fsk_tx_end()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    uint8_t payload[20];
+    service_action_e a = SERVICE_NONE;
+    int i;
+
+    memset(payload, 0x33, sizeof(payload));
+    fsk_setup(radio, fsk, true, true, 0);
+    radio.write_u16(REG_FSK_BITRATEMSB, 0x0a00);    // 12.5kbps behind the driver's back: 80us per bit
+    fsk.enable(true);
+
+    fsk.start_tx(payload, sizeof(payload));
+    /* sleep until a DIO edge is queued, or until tx_end_us once PacketSent is seen */
+    for (i = 0; i < LOOP_LIMIT && (a = fsk.service()) == SERVICE_NONE; i++) {
+        if (fsk.tx_ending)
+            hal.wait_us(fsk.tx_end_us - hal.now_us());
+        else
+            hal.wait_us(100);
+    }
+
+    CHECK_EQ(a, SERVICE_TX_DONE);
+    CHECK_EQ(fsk.tx_end_us - radio.dio_time_us[0], 80);
+    CHECK_EQ(sim.tx_frames.size(), 1);
+}
+
+/* sequencer request with no response: an application sleeping on DIO interrupts
+ * wakes for PacketSent and at seq_end_us */
+static void test_fsk_seq_timeout()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    uint8_t payload[FSK_FIFO_SIZE];
+    service_action_e a = SERVICE_NONE;
+    uint32_t t0;
+    int wakes, spins = 0;
+
+    memset(payload, 0x44, sizeof(payload));
+    fsk_setup(radio, fsk, true, true, 0);
+    CHECK(!fsk.seq_tx_rx(payload, FSK_FIFO_SIZE, 2000));     // no room for length byte
+    CHECK_EQ(sim.tx_frames.size(), 0);
+
+    t0 = hal.now_us();
+    CHECK(fsk.seq_tx_rx(payload, 20, 2000));
+    for (wakes = 0; wakes < 100 && (a = fsk.service()) == SERVICE_NONE; wakes++) {
+        if (radio.dio_events.empty() && (int32_t)(hal.now_us() - fsk.seq_end_us) >= 0)
+            spins++;    // nothing to sleep until: application would busy-loop
+        while (radio.dio_events.empty() && (int32_t)(hal.now_us() - fsk.seq_end_us) < 0)
+            hal.wait_us(10);
+    }
+
+    CHECK_EQ(a, SERVICE_RX_TIMEOUT);
+    CHECK_EQ(spins, 0);
+    CHECK(wakes < 10);
+    CHECK(hal.now_us() - t0 >= 2000);
+    CHECK_EQ(sim.tx_frames.size(), 1);
+    CHECK_EQ(fsk.seq_state, FSK_SEQ_OFF);
+}
+
+/* larger than the FIFO: refilled on FifoLevel falling */
+static void test_fsk_tx_stream(bool irq, bool variable, uint16_t len)
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    static uint8_t payload[2047];
+    int i;
+
+    for (i = 0; i < len; i++)
+        payload[i] = i * 3 + 1;
+    fsk_setup(radio, fsk, irq, variable, len);
+
+    fsk.start_tx(payload, len);
+    for (i = 0; i < LOOP_LIMIT && fsk.service() != SERVICE_TX_DONE; i++)
+        hal.wait_us(100);
+
+    CHECK(i < LOOP_LIMIT);
+    CHECK_EQ(sim.fsk_tx_underrun, 0);
+    CHECK_EQ(sim.tx_frames.size(), 1);
+    if (sim.tx_frames.size() == 1) {
+        CHECK_EQ(sim.tx_frames[0].size(), len);
+        CHECK(memcmp(&sim.tx_frames[0][0], payload, len) == 0);
+    }
+}
+
+/* larger than the FIFO: drained on FifoLevel, rest read at PayloadReady */
+static void test_fsk_rx_stream(bool irq, bool variable, uint16_t len, bool crc_ok)
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    static uint8_t payload[2047], rx[2048];
+    service_action_e a = SERVICE_NONE;
+    int i;
+
+    for (i = 0; i < len; i++)
+        payload[i] = i * 7 + 3;
+    memset(rx, 0, sizeof(rx));
+    fsk_setup(radio, fsk, irq, variable, len);
+
+    fsk.start_rx(rx, sizeof(rx) - 1);
+    sim.fsk_rx(payload, len, crc_ok);
+    for (i = 0; i < LOOP_LIMIT && (a = fsk.service()) == SERVICE_NONE; i++)
+        hal.wait_us(150);
+
+    CHECK_EQ(a, SERVICE_READ_FIFO);
+    CHECK_EQ(fsk.rx_buf_length, len);
+    CHECK_EQ(fsk.rx_crc_ok, crc_ok);
+    CHECK(memcmp(rx, payload, len) == 0);
+    CHECK_EQ(rx[len], 0);
+    CHECK_EQ(radio.read_reg(REG_FSK_IRQFLAGS2) & 0x10, 0);  // no FifoOverrun
+}
+
+/* fits the FIFO: read once at PayloadReady into rx_dest */
+/* leaving streaming RX puts back the application's CrcAutoClearOff */
+static void test_fsk_rx_crc_auto_clear()
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    uint8_t rx[64];
+    int on;
+
+    fsk_setup(radio, fsk, false, true, 0);
+    for (on = 1; on >= 0; on--) {
+        fsk.RegPktConfig1.bits.CrcAutoClearOff = on;
+        radio.write_reg(REG_FSK_PACKETCONFIG1, fsk.RegPktConfig1.octet);
+        fsk.start_rx(rx, sizeof(rx));
+        CHECK_EQ((sim.peek(REG_FSK_PACKETCONFIG1) >> 3) & 1, 1);
+        fsk.start_rx();
+        CHECK_EQ((sim.peek(REG_FSK_PACKETCONFIG1) >> 3) & 1, on);
+    }
+}
+
+static void test_fsk_rx(bool irq)
+{
+    SX127x_sim sim(SX1276);
+    SX127x_host_hal hal(sim);
+    SX127x radio(hal);
+    SX127x_fsk fsk(radio);
+    uint8_t payload[30], rx[256];
+    service_action_e a = SERVICE_NONE;
+    int i;
+
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = 0xa0 + i;
+    fsk_setup(radio, fsk, irq, true, 0);
+    radio.rx_dest = rx;
+
+    fsk.start_rx();
+    sim.fsk_rx(payload, sizeof(payload));
+    for (i = 0; i < LOOP_LIMIT && (a = fsk.service()) == SERVICE_NONE; i++)
+        hal.wait_us(150);
+
+    CHECK_EQ(a, SERVICE_READ_FIFO);
+    CHECK_EQ(fsk.rx_buf_length, sizeof(payload));
+    CHECK(memcmp(rx, payload, sizeof(payload)) == 0);
+}
+
+int main()
+{
+    int irq;
+
+    for (irq = 0; irq < 2; irq++) {
+        test_lora_tx(irq);
+        test_lora_rx(irq);
+        test_lora_hop_cad(irq);
+        test_fsk_tx(irq);
+        test_fsk_tx_stream(irq, true, 255);
+        test_fsk_tx_stream(irq, false, 2047);
+        test_fsk_rx_stream(irq, true, 200, true);
+        test_fsk_rx_stream(irq, false, 1000, true);
+        test_fsk_rx_stream(irq, true, 180, false);
+        test_fsk_rx(irq);
+    }
+    test_lora_rx_timeout(false);
+    test_lora_rx_timeout(true);
+    test_lora_sniff();
+    test_lora_stats_random();
+    test_fsk_tx_end();
+    test_fsk_seq_timeout();
+    test_fsk_rx_crc_auto_clear();
+    return TEST_RESULT("test_sim");
+}